@@ -0,0 +1,41 @@
+"""Compares the interpreter against the JIT modes for short and long scripts.
+
+Short scripts are dominated by the fixed cost of a call, long numeric loops
+by execution speed; run `python bench.py` after building the extension.
+"""
+
+from timeit import default_timer
+
+from spindly import js, metrics, Runtime
+
+SCRIPTS = [
+    ('short', '1 + 2', 2000),
+    ('loop', 'var t = 0; for (var i = 0; i < 1000000; i++) { t += i % 7; } t', 20),
+    ('float', 'var t = 0; for (var i = 1; i < 200000; i++) { t += Math.sqrt(i) / i; } t', 20),
+]
+
+MODES = [False, 'trace', 'method', True]
+
+
+def bench(run, script, repeat, jit):
+    started = default_timer()
+    for i in range(repeat):
+        run(script, jit=jit)
+    return (default_timer() - started) / repeat
+
+
+def main():
+    runtime = Runtime()
+    print('%-8s %-10s %14s %14s' % ('script', 'jit', 'js() ms', 'Runtime ms'))
+    for name, script, repeat in SCRIPTS:
+        for jit in MODES:
+            fresh = bench(js, script, repeat, jit)
+            reused = bench(runtime.js, script, repeat, jit)
+            print('%-8s %-10s %14.4f %14.4f' % (name, jit, fresh * 1000, reused * 1000))
+    print('')
+    for mode, entry in sorted(metrics().items()):
+        print('%-12s %8d runs %10.3f s' % (mode, entry['runs'], entry['seconds']))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,143 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "frames.h"
+
+static int set_address(struct sockaddr_un *address, const char *path) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+int frame_connect(const char *path) {
+    struct sockaddr_un address;
+    if (set_address(&address, path) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+int frame_listen(const char *path, int backlog) {
+    struct sockaddr_un address;
+    if (set_address(&address, path) < 0) {
+        return -1;
+    }
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    /* the socket must not be connectable by others even for a moment */
+    mode_t mask = umask(0177);
+    int bound = bind(fd, (struct sockaddr *) &address, sizeof(address));
+    umask(mask);
+    if (bound < 0 || chmod(path, 0600) < 0 || listen(fd, backlog) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t count = send(fd, data, length, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            return -1;
+        }
+        data += count;
+        length -= count;
+    }
+    return 0;
+}
+
+/* Returns 1 once length bytes are read, 0 on end of stream before any. */
+static int receive_all(int fd, char *data, size_t length) {
+    size_t received = 0;
+    while (received < length) {
+        ssize_t count = recv(fd, data + received, length - received, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            return -1;
+        }
+        if (count == 0) {
+            if (received == 0) {
+                return 0;
+            }
+            errno = ECONNRESET;
+            return -1;
+        }
+        received += count;
+    }
+    return 1;
+}
+
+int frame_write(int fd, const char *data, size_t length) {
+    uint32_t header = htonl((uint32_t) length);
+    if (length > UINT32_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (send_all(fd, (const char *) &header, sizeof(header)) < 0 || send_all(fd, data, length) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+int frame_read(int fd, char **data, size_t *length, size_t limit) {
+    uint32_t header;
+    int retval = receive_all(fd, (char *) &header, sizeof(header));
+    *data = NULL;
+    if (retval <= 0) {
+        return retval;
+    }
+    *length = ntohl(header);
+    if (*length > limit) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    *data = malloc(*length ? *length : 1);
+    if (!*data) {
+        errno = ENOMEM;
+        return -1;
+    }
+    retval = receive_all(fd, *data, *length);
+    if (retval <= 0) {
+        free(*data);
+        *data = NULL;
+        if (retval == 0) {
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,27 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef SPINDLY_FRAMES_H
+#define SPINDLY_FRAMES_H
+
+#include <stddef.h>
+
+/* Framing spoken by spindlyd and its clients over a Unix domain socket:
+ * every frame is a 32-bit big-endian payload length and the payload.  All
+ * functions return -1 (or 0 for frame_read at end of stream) and set errno
+ * on failure.  This file does not depend on Python or the engine. */
+
+int frame_connect(const char *path);
+
+/* Binds path (replacing a stale socket) with owner-only permissions.  The
+ * process umask is changed while binding, so call it before starting
+ * threads that create files. */
+int frame_listen(const char *path, int backlog);
+
+int frame_write(int fd, const char *data, size_t length);
+
+/* Reads one frame into a malloc'd *data, refusing payloads over limit. */
+int frame_read(int fd, char **data, size_t *length, size_t limit);
+
+#endif
@@ -0,0 +1,1190 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <jsapi.h>
+
+#include "sandbox.h"
+
+/* A single-producer, single-consumer byte ring in shared memory.  Messages
+ * are a 32-bit length followed by the payload and may be larger than the
+ * ring, in which case they stream through it.  head and tail only grow;
+ * signal is bumped after every change and is the futex both ends wait on. */
+struct ring {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t signal;
+    uint32_t size;
+};
+
+#define RING_DATA(r) ((char *) (r) + sizeof(struct ring))
+
+/* cpu_ns is the CPU time the worker spent on its last request, written
+ * before the response. */
+struct slot {
+    pid_t pid;
+    uint32_t retiring;
+    uint64_t cpu_ns;
+};
+
+#define SLOT_HEADER 64
+
+/* usage is the tenant's CPU time divided by its weight: the key fair
+ * queuing orders tenants by. */
+struct tenant {
+    struct sandbox_tenant_stats stats;
+    double usage;
+};
+
+/* A call waiting for a worker.  A finishing call hands its worker straight
+ * to the waiter that should run next by setting index. */
+struct pending_call {
+    pthread_cond_t ready;
+    int index;
+    int priority;
+    struct tenant *tenant;
+    struct pending_call *next;
+};
+
+struct sandbox {
+    struct sandbox_options options;
+    char *memory;
+    size_t slot_bytes;
+    int *busy;
+    pthread_mutex_t mutex;
+    struct pending_call *head;
+    struct pending_call *tail;
+    struct sandbox_stats stats;
+    struct tenant tenants[SANDBOX_MAX_TENANTS];
+    int tenant_count;
+    double usage_floor;
+    int dead;
+    pid_t zygote;
+    int control;
+};
+
+static struct slot *get_slot(struct sandbox *sandbox, int index) {
+    return (struct slot *) (sandbox->memory + sandbox->slot_bytes * index);
+}
+
+static struct ring *get_request_ring(struct sandbox *sandbox, int index) {
+    return (struct ring *) ((char *) get_slot(sandbox, index) + SLOT_HEADER);
+}
+
+static struct ring *get_response_ring(struct sandbox *sandbox, int index) {
+    struct ring *request = get_request_ring(sandbox, index);
+    return (struct ring *) (RING_DATA(request) + request->size);
+}
+
+static long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+static double monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void wake_ring(struct ring *ring) {
+    __atomic_add_fetch(&ring->signal, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &ring->signal, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* How one side waits on a ring.  The host gives a deadline and watches the
+ * worker's pid, which is 0 while the zygote forks the worker and -1 if that
+ * fork failed, and the zygote's; a worker waits indefinitely. */
+struct waiter {
+    long deadline;
+    pid_t *pid;
+    pid_t zygote;
+};
+
+/* Leaves the zygote unreaped for sandbox_close. */
+static int zygote_exited(pid_t zygote) {
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_PID, zygote, &info, WEXITED | WNOHANG | WNOWAIT) < 0) {
+        return errno == ECHILD;
+    }
+    return info.si_pid == zygote;
+}
+
+static enum sandbox_status wait_ring(struct ring *ring, uint32_t seen, const struct waiter *waiter) {
+    long slice = 100;
+    if (waiter->deadline > 0) {
+        long remaining = waiter->deadline - monotonic_ms();
+        if (remaining <= 0) {
+            return SANDBOX_TIMEOUT;
+        }
+        slice = remaining < slice ? remaining : slice;
+    }
+
+    struct timespec timeout = {slice / 1000, (slice % 1000) * 1000000L};
+    syscall(SYS_futex, &ring->signal, FUTEX_WAIT, seen, waiter->pid ? &timeout : NULL, NULL, 0);
+
+    if (waiter->pid) {
+        pid_t pid = __atomic_load_n(waiter->pid, __ATOMIC_ACQUIRE);
+        if (pid < 0 || (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH)
+                || (pid == 0 && zygote_exited(waiter->zygote))) {
+            return SANDBOX_CRASHED;
+        }
+    }
+    return SANDBOX_OK;
+}
+
+static enum sandbox_status put_bytes(struct ring *ring, const char *data, size_t length,
+        const struct waiter *waiter) {
+    while (length > 0) {
+        uint32_t seen = __atomic_load_n(&ring->signal, __ATOMIC_ACQUIRE);
+        uint32_t head = ring->head;
+        uint32_t available = ring->size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+        if (available == 0) {
+            enum sandbox_status status = wait_ring(ring, seen, waiter);
+            if (status != SANDBOX_OK) {
+                return status;
+            }
+            continue;
+        }
+
+        uint32_t count = length < available ? length : available;
+        uint32_t offset = head % ring->size;
+        uint32_t first = count < ring->size - offset ? count : ring->size - offset;
+        memcpy(RING_DATA(ring) + offset, data, first);
+        memcpy(RING_DATA(ring), data + first, count - first);
+        __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+        wake_ring(ring);
+        data += count;
+        length -= count;
+    }
+    return SANDBOX_OK;
+}
+
+static enum sandbox_status get_bytes(struct ring *ring, char *data, size_t length,
+        const struct waiter *waiter) {
+    while (length > 0) {
+        uint32_t seen = __atomic_load_n(&ring->signal, __ATOMIC_ACQUIRE);
+        uint32_t tail = ring->tail;
+        uint32_t available = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+        if (available == 0) {
+            enum sandbox_status status = wait_ring(ring, seen, waiter);
+            if (status != SANDBOX_OK) {
+                return status;
+            }
+            continue;
+        }
+
+        uint32_t count = length < available ? length : available;
+        uint32_t offset = tail % ring->size;
+        uint32_t first = count < ring->size - offset ? count : ring->size - offset;
+        memcpy(data, RING_DATA(ring) + offset, first);
+        memcpy(data + first, RING_DATA(ring), count - first);
+        __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+        wake_ring(ring);
+        data += count;
+        length -= count;
+    }
+    return SANDBOX_OK;
+}
+
+static enum sandbox_status write_message(struct ring *ring, const char *data, size_t length,
+        const struct waiter *waiter) {
+    uint32_t prefix = length;
+    enum sandbox_status status = put_bytes(ring, (const char *) &prefix, sizeof(prefix), waiter);
+    if (status != SANDBOX_OK) {
+        return status;
+    }
+    return put_bytes(ring, data, length, waiter);
+}
+
+/* Reads one message into a malloc'd, NUL-terminated buffer. */
+static enum sandbox_status read_message(struct ring *ring, char **data, size_t *length,
+        const struct waiter *waiter) {
+    uint32_t prefix;
+    enum sandbox_status status = get_bytes(ring, (char *) &prefix, sizeof(prefix), waiter);
+    if (status != SANDBOX_OK) {
+        return status;
+    }
+
+    *data = malloc(prefix + 1);
+    if (!*data) {
+        return SANDBOX_SYSTEM_ERROR;
+    }
+    status = get_bytes(ring, *data, prefix, waiter);
+    if (status != SANDBOX_OK) {
+        free(*data);
+        *data = NULL;
+        return status;
+    }
+    (*data)[prefix] = '\0';
+    *length = prefix;
+    return SANDBOX_OK;
+}
+
+static void reset_ring(struct ring *ring) {
+    ring->head = 0;
+    ring->tail = 0;
+    wake_ring(ring);
+}
+
+/* The engine: a runtime and context whose global holds the prelude, plus a
+ * cache of compiled scripts keyed by source.  Requests are evaluated in a
+ * fresh scope object whose prototype is that global, so the prelude is
+ * shared while per-request variables are not.  Scripts are compiled
+ * without compile-and-go so that one compiled script runs in any scope. */
+
+struct buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+static int append_buffer(struct buffer *buffer, const char *data, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->length + length) {
+            capacity *= 2;
+        }
+        char *grown = realloc(buffer->data, capacity);
+        if (!grown) {
+            return 0;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 1;
+}
+
+#define SCRIPT_CACHE_SIZE 256
+
+struct cached_script {
+    uint32_t hash;
+    jschar *source;
+    size_t length;
+    JSObject *script;
+};
+
+struct sandbox_engine {
+    JSContext *context;
+    JSObject *global;
+    char error[1024];
+    struct buffer response;
+    struct cached_script scripts[SCRIPT_CACHE_SIZE];
+    unsigned long hits;
+    unsigned long misses;
+    pthread_t watchdog;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    struct timespec deadline;
+    double expires;
+    int running;
+    int armed;
+    int fired;
+    int cancelled;
+    int closing;
+};
+
+static JSClass engine_global_class = {
+    .name = "global",
+    .flags = JSCLASS_GLOBAL_FLAGS,
+    .addProperty = JS_PropertyStub,
+    .delProperty = JS_PropertyStub,
+    .getProperty = JS_PropertyStub,
+    .setProperty = JS_StrictPropertyStub,
+    .enumerate = JS_EnumerateStub,
+    .resolve = JS_ResolveStub,
+    .convert = JS_ConvertStub,
+    .finalize = JS_FinalizeStub,
+    JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
+static JSClass engine_scope_class = {
+    .name = "scope",
+    .flags = 0,
+    .addProperty = JS_PropertyStub,
+    .delProperty = JS_PropertyStub,
+    .getProperty = JS_PropertyStub,
+    .setProperty = JS_StrictPropertyStub,
+    .enumerate = JS_EnumerateStub,
+    .resolve = JS_ResolveStub,
+    .convert = JS_ConvertStub,
+    .finalize = JS_FinalizeStub,
+    JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
+static void report_engine_error(JSContext *context, const char *message, JSErrorReport *report) {
+    struct sandbox_engine *engine = JS_GetContextPrivate(context);
+    if (report->filename) {
+        snprintf(engine->error, sizeof(engine->error), "%s:%u:%s", report->filename,
+            (unsigned int) report->lineno, message);
+    } else {
+        snprintf(engine->error, sizeof(engine->error), "%s", message);
+    }
+}
+
+/* Ends a script that overran its timeout without raising a catchable
+ * exception. */
+static JSBool interrupt_engine(JSContext *context) {
+    struct sandbox_engine *engine = JS_GetContextPrivate(context);
+    return engine->fired ? JS_FALSE : JS_TRUE;
+}
+
+/* __remaining_ms(), as in the extension. */
+static JSBool engine_remaining_ms(JSContext *context, uintN argc, jsval *vp) {
+    struct sandbox_engine *engine = JS_GetContextPrivate(context);
+    if (engine->expires == 0) {
+        JS_SET_RVAL(context, vp, JS_GetPositiveInfinityValue(context));
+        return JS_TRUE;
+    }
+    jsdouble remaining = (engine->expires - monotonic_seconds()) * 1000;
+    return JS_NewNumberValue(context, remaining > 0 ? remaining : 0, vp);
+}
+
+static void *run_engine_watchdog(void *ptr) {
+    struct sandbox_engine *engine = (struct sandbox_engine *) ptr;
+
+    pthread_mutex_lock(&engine->mutex);
+    while (!engine->closing) {
+        if (!engine->armed) {
+            pthread_cond_wait(&engine->changed, &engine->mutex);
+            continue;
+        }
+        int retval = pthread_cond_timedwait(&engine->changed, &engine->mutex, &engine->deadline);
+        if (engine->armed && retval == ETIMEDOUT) {
+            engine->fired = 1;
+            engine->armed = 0;
+            JS_TriggerOperationCallback(engine->context);
+        }
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    return NULL;
+}
+
+static void arm_engine_watchdog(struct sandbox_engine *engine, double timeout) {
+    pthread_mutex_lock(&engine->mutex);
+    engine->running = 1;
+    engine->fired = 0;
+    engine->cancelled = 0;
+    engine->armed = timeout > 0;
+    if (engine->armed) {
+        clock_gettime(CLOCK_REALTIME, &engine->deadline);
+        engine->deadline.tv_sec += (time_t) timeout;
+        engine->deadline.tv_nsec += (long) ((timeout - (time_t) timeout) * 1e9);
+        if (engine->deadline.tv_nsec >= 1000000000L) {
+            engine->deadline.tv_sec++;
+            engine->deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    pthread_cond_broadcast(&engine->changed);
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+static void disarm_engine_watchdog(struct sandbox_engine *engine) {
+    pthread_mutex_lock(&engine->mutex);
+    engine->running = 0;
+    engine->armed = 0;
+    pthread_cond_broadcast(&engine->changed);
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+/* Payloads are ASCII, so widening each byte decodes them exactly. */
+static JSBool parse_json(JSContext *context, const char *data, size_t length, jsval *value) {
+    jschar *chars = malloc(sizeof(jschar) * (length + 1));
+    size_t i;
+    if (!chars) {
+        return JS_FALSE;
+    }
+    for (i = 0; i < length; i++) {
+        chars[i] = (unsigned char) data[i];
+    }
+    JSBool ok = JS_ParseJSON(context, chars, length, value);
+    free(chars);
+    return ok;
+}
+
+/* Keeps stringified results ASCII by escaping everything past 0x7f, which
+ * JSON.stringify can only have left inside string literals. */
+static JSBool write_json(const jschar *chars, uint32 length, void *data) {
+    struct buffer *buffer = (struct buffer *) data;
+    char escaped[8];
+    uint32 i;
+
+    for (i = 0; i < length; i++) {
+        if (chars[i] < 0x80) {
+            char c = (char) chars[i];
+            if (!append_buffer(buffer, &c, 1)) {
+                return JS_FALSE;
+            }
+        } else {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned int) chars[i]);
+            if (!append_buffer(buffer, escaped, 6)) {
+                return JS_FALSE;
+            }
+        }
+    }
+    return JS_TRUE;
+}
+
+static uint32_t hash_source(const jschar *chars, size_t length) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ chars[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Returns the compiled script for source, compiling and caching it on a
+ * miss.  A colliding entry is simply replaced. */
+static JSObject *compile_source(struct sandbox_engine *engine, jsval source) {
+    JSContext *context = engine->context;
+    size_t length;
+
+    if (!JSVAL_IS_STRING(source)) {
+        snprintf(engine->error, sizeof(engine->error), "script must be a string");
+        return NULL;
+    }
+    const jschar *chars = JS_GetStringCharsAndLength(context, JSVAL_TO_STRING(source), &length);
+    if (!chars) {
+        return NULL;
+    }
+
+    uint32_t hash = hash_source(chars, length);
+    struct cached_script *entry = &engine->scripts[hash % SCRIPT_CACHE_SIZE];
+    if (entry->script && entry->hash == hash && entry->length == length
+            && memcmp(entry->source, chars, length * sizeof(jschar)) == 0) {
+        engine->hits++;
+        return entry->script;
+    }
+    engine->misses++;
+
+    JSObject *obj = JS_CompileUCScript(context, engine->global, chars, length, "spindly", 1);
+    if (!obj) {
+        return NULL;
+    }
+
+    jschar *copy = malloc(length * sizeof(jschar) + 1);
+    if (!copy) {
+        return obj;
+    }
+    memcpy(copy, chars, length * sizeof(jschar));
+    if (entry->script) {
+        free(entry->source);
+    } else {
+        JS_AddNamedObjectRoot(context, &entry->script, "spindly script cache");
+    }
+    entry->hash = hash;
+    entry->source = copy;
+    entry->length = length;
+    entry->script = obj;
+    return obj;
+}
+
+static JSBool run_source(struct sandbox_engine *engine, JSObject *scope, jsval source, jsval *rvalue) {
+    JSObject *script = compile_source(engine, source);
+    if (!script) {
+        return JS_FALSE;
+    }
+    return JS_ExecuteScript(engine->context, scope, script, rvalue);
+}
+
+static int load_prelude(struct sandbox_engine *engine, const char *prelude, size_t length) {
+    JSContext *context = engine->context;
+    jsval sources, source, rvalue;
+    jsuint count, i;
+
+    if (!parse_json(context, prelude, length, &sources) || !JSVAL_IS_OBJECT(sources) || JSVAL_IS_NULL(sources)
+            || !JS_GetArrayLength(context, JSVAL_TO_OBJECT(sources), &count)) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        size_t chars_length;
+        if (!JS_GetElement(context, JSVAL_TO_OBJECT(sources), i, &source) || !JSVAL_IS_STRING(source)) {
+            return 0;
+        }
+        const jschar *chars = JS_GetStringCharsAndLength(context, JSVAL_TO_STRING(source), &chars_length);
+        if (!chars || !JS_EvaluateUCScript(context, engine->global, chars, chars_length, "prelude", 1, &rvalue)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void enter_engine(struct sandbox_engine *engine) {
+#ifdef JS_THREADSAFE
+    JS_SetContextThread(engine->context);
+    JS_BeginRequest(engine->context);
+#endif
+}
+
+static void leave_engine(struct sandbox_engine *engine) {
+#ifdef JS_THREADSAFE
+    JS_EndRequest(engine->context);
+    JS_ClearContextThread(engine->context);
+#endif
+}
+
+struct sandbox_engine *sandbox_engine_open(const char *prelude, size_t length) {
+    struct sandbox_engine *engine = calloc(1, sizeof(struct sandbox_engine));
+    if (!engine) {
+        return NULL;
+    }
+    pthread_mutex_init(&engine->mutex, NULL);
+    pthread_cond_init(&engine->changed, NULL);
+
+    JSRuntime *runtime = JS_NewRuntime(64L * 1024L * 1024L);
+    engine->context = runtime ? JS_NewContext(runtime, 8192) : NULL;
+    if (!engine->context) {
+        if (runtime) {
+            JS_DestroyRuntime(runtime);
+        }
+        free(engine);
+        return NULL;
+    }
+    JS_SetContextPrivate(engine->context, engine);
+    JS_SetOptions(engine->context, JSOPTION_VAROBJFIX);
+    JS_SetVersion(engine->context, JSVERSION_LATEST);
+    JS_SetErrorReporter(engine->context, report_engine_error);
+    JS_SetOperationCallback(engine->context, interrupt_engine);
+
+    int ok = 0;
+    engine->global = JS_NewCompartmentAndGlobalObject(engine->context, &engine_global_class, NULL);
+    if (engine->global) {
+        JS_SetGlobalObject(engine->context, engine->global);
+        ok = JS_InitStandardClasses(engine->context, engine->global)
+            && JS_DefineFunction(engine->context, engine->global, "__remaining_ms", engine_remaining_ms, 0,
+                JSPROP_READONLY | JSPROP_PERMANENT)
+            && (length == 0 || load_prelude(engine, prelude, length))
+            && pthread_create(&engine->watchdog, NULL, run_engine_watchdog, engine) == 0;
+    }
+    if (!ok) {
+        JS_DestroyContext(engine->context);
+        JS_DestroyRuntime(runtime);
+        free(engine);
+        return NULL;
+    }
+#ifdef JS_THREADSAFE
+    JS_ClearContextThread(engine->context);
+#endif
+    return engine;
+}
+
+const char *sandbox_engine_run(struct sandbox_engine *engine, const char *request, size_t length,
+        size_t *response_length) {
+    JSContext *context = engine->context;
+    struct buffer *response = &engine->response;
+    jsval value, script, params, timeout, deadline, rvalue;
+    jsdouble seconds = 0, expires = 0;
+    JSBool ok = JS_FALSE;
+
+    enter_engine(engine);
+    engine->error[0] = '\0';
+    response->length = 0;
+    append_buffer(response, "R", 1);
+
+    if (!parse_json(context, request, length, &value) || !JSVAL_IS_OBJECT(value) || JSVAL_IS_NULL(value)) {
+        if (!engine->error[0]) {
+            snprintf(engine->error, sizeof(engine->error), "malformed request");
+        }
+        goto failed;
+    }
+
+    JSObject *scope = JS_NewObject(context, &engine_scope_class, engine->global, NULL);
+    if (!scope || !JS_SetParent(context, scope, NULL)
+            || !JS_GetProperty(context, JSVAL_TO_OBJECT(value), "script", &script)
+            || !JS_GetProperty(context, JSVAL_TO_OBJECT(value), "params", &params)
+            || !JS_GetProperty(context, JSVAL_TO_OBJECT(value), "timeout", &timeout)
+            || !JS_GetProperty(context, JSVAL_TO_OBJECT(value), "deadline", &deadline)) {
+        goto failed;
+    }
+    if ((JSVAL_IS_NUMBER(timeout) && !JS_ValueToNumber(context, timeout, &seconds))
+            || (JSVAL_IS_NUMBER(deadline) && !JS_ValueToNumber(context, deadline, &expires))) {
+        goto failed;
+    }
+
+    /* deadline is absolute on CLOCK_MONOTONIC, which every process shares */
+    double now = monotonic_seconds();
+    engine->expires = seconds > 0 ? now + seconds : 0;
+    if (expires > 0 && (engine->expires == 0 || expires < engine->expires)) {
+        engine->expires = expires;
+    }
+    if (engine->expires > 0 && engine->expires <= now) {
+        snprintf(engine->error, sizeof(engine->error), "deadline exceeded");
+        goto failed;
+    }
+
+    if (JSVAL_IS_OBJECT(params) && !JSVAL_IS_NULL(params)) {
+        JSIdArray *ids = JS_Enumerate(context, JSVAL_TO_OBJECT(params));
+        jsint i;
+        if (!ids) {
+            goto failed;
+        }
+        for (i = 0; i < ids->length; i++) {
+            jsval param;
+            if (!JS_GetPropertyById(context, JSVAL_TO_OBJECT(params), ids->vector[i], &param)
+                    || !JS_SetPropertyById(context, scope, ids->vector[i], &param)) {
+                JS_DestroyIdArray(context, ids);
+                goto failed;
+            }
+        }
+        JS_DestroyIdArray(context, ids);
+    }
+
+    arm_engine_watchdog(engine, engine->expires > 0 ? engine->expires - now : 0);
+    ok = run_source(engine, scope, script, &rvalue);
+    disarm_engine_watchdog(engine);
+    if (!ok) {
+        if (engine->cancelled) {
+            snprintf(engine->error, sizeof(engine->error), "cancelled");
+        } else if (engine->fired) {
+            snprintf(engine->error, sizeof(engine->error), "timeout");
+        }
+        goto failed;
+    }
+
+    if (!JS_Stringify(context, &rvalue, NULL, JSVAL_NULL, write_json, response)) {
+        goto failed;
+    }
+    if (response->length == 1) {
+        append_buffer(response, "null", 4);
+    }
+    goto done;
+
+failed:
+    JS_ClearPendingException(context);
+    response->length = 0;
+    append_buffer(response, "E", 1);
+    if (!engine->error[0]) {
+        snprintf(engine->error, sizeof(engine->error), "script failed");
+    }
+    append_buffer(response, engine->error, strlen(engine->error));
+
+done:
+    JS_MaybeGC(context);
+    leave_engine(engine);
+    *response_length = response->length;
+    return response->data;
+}
+
+void sandbox_engine_cancel(struct sandbox_engine *engine) {
+    pthread_mutex_lock(&engine->mutex);
+    if (engine->running) {
+        engine->fired = 1;
+        engine->cancelled = 1;
+        engine->armed = 0;
+        JS_TriggerOperationCallback(engine->context);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+void sandbox_engine_stats(struct sandbox_engine *engine, unsigned long *hits, unsigned long *misses) {
+    *hits = engine->hits;
+    *misses = engine->misses;
+}
+
+void sandbox_engine_close(struct sandbox_engine *engine) {
+    JSRuntime *runtime = JS_GetRuntime(engine->context);
+    int i;
+
+    pthread_mutex_lock(&engine->mutex);
+    engine->closing = 1;
+    pthread_cond_broadcast(&engine->changed);
+    pthread_mutex_unlock(&engine->mutex);
+    pthread_join(engine->watchdog, NULL);
+
+    enter_engine(engine);
+    for (i = 0; i < SCRIPT_CACHE_SIZE; i++) {
+        if (engine->scripts[i].script) {
+            JS_RemoveObjectRoot(engine->context, &engine->scripts[i].script);
+            free(engine->scripts[i].source);
+        }
+    }
+#ifdef JS_THREADSAFE
+    JS_EndRequest(engine->context);
+#endif
+    JS_DestroyContext(engine->context);
+    JS_DestroyRuntime(runtime);
+    pthread_cond_destroy(&engine->changed);
+    pthread_mutex_destroy(&engine->mutex);
+    free(engine->response.data);
+    free(engine);
+}
+
+/* Everything below, up to the host side, runs in worker processes. */
+
+static size_t resident_bytes(void) {
+    unsigned long size, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static void run_worker(struct sandbox *sandbox, int index) {
+    struct ring *requests = get_request_ring(sandbox, index);
+    struct ring *responses = get_response_ring(sandbox, index);
+    struct slot *slot = get_slot(sandbox, index);
+    struct waiter waiter = {0, NULL, 0};
+    unsigned long calls = 0;
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    struct sandbox_engine *engine = sandbox_engine_open(sandbox->options.prelude, sandbox->options.prelude_length);
+    if (!engine) {
+        _exit(1);
+    }
+
+    for (;;) {
+        char *request;
+        size_t length, response_length;
+        if (read_message(requests, &request, &length, &waiter) != SANDBOX_OK) {
+            _exit(1);
+        }
+        struct timespec before, after;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &before);
+        const char *response = sandbox_engine_run(engine, request, length, &response_length);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &after);
+        free(request);
+        __atomic_store_n(&slot->cpu_ns, (uint64_t) ((after.tv_sec - before.tv_sec) * 1000000000LL
+            + (after.tv_nsec - before.tv_nsec)), __ATOMIC_RELEASE);
+
+        calls++;
+        if ((sandbox->options.max_calls && calls >= sandbox->options.max_calls)
+                || (sandbox->options.max_rss && resident_bytes() > sandbox->options.max_rss)) {
+            __atomic_store_n(&slot->retiring, 1, __ATOMIC_RELEASE);
+        }
+        if (write_message(responses, response, response_length, &waiter) != SANDBOX_OK) {
+            _exit(1);
+        }
+        if (slot->retiring) {
+            _exit(0);
+        }
+    }
+}
+
+/* The zygote forks a worker for every slot index written to control, and
+ * kills all workers once the host closes control. */
+static void run_zygote(struct sandbox *sandbox, int control) {
+    int index;
+
+    signal(SIGCHLD, SIG_IGN);
+    while (read(control, &index, sizeof(index)) == sizeof(index)) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(control);
+            run_worker(sandbox, index);
+        }
+        __atomic_store_n(&get_slot(sandbox, index)->pid, pid > 0 ? pid : -1, __ATOMIC_RELEASE);
+    }
+
+    for (index = 0; index < sandbox->options.workers; index++) {
+        pid_t pid = get_slot(sandbox, index)->pid;
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+        }
+    }
+    _exit(0);
+}
+
+/* Host side. */
+
+static int spawn_worker(struct sandbox *sandbox, int index) {
+    struct slot *slot = get_slot(sandbox, index);
+    pid_t pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+    long deadline = monotonic_ms() + 1000;
+
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        while (kill(pid, 0) == 0 && monotonic_ms() < deadline) {
+            usleep(1000);
+        }
+    }
+
+    reset_ring(get_request_ring(sandbox, index));
+    reset_ring(get_response_ring(sandbox, index));
+    slot->retiring = 0;
+    __atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+    /* fails with EPIPE once the zygote has died */
+    if (write(sandbox->control, &index, sizeof(index)) != sizeof(index)) {
+        __atomic_store_n(&slot->pid, -1, __ATOMIC_RELEASE);
+        return 0;
+    }
+    return 1;
+}
+
+struct sandbox *sandbox_open(const struct sandbox_options *options) {
+    struct sandbox *sandbox = calloc(1, sizeof(struct sandbox));
+    int fds[2], index;
+
+    if (!sandbox) {
+        return NULL;
+    }
+    sandbox->options = *options;
+    sandbox->control = -1;
+    sandbox->options.prelude = NULL;
+    if (options->prelude_length > 0) {
+        char *prelude = malloc(options->prelude_length);
+        if (!prelude) {
+            goto error;
+        }
+        memcpy(prelude, options->prelude, options->prelude_length);
+        sandbox->options.prelude = prelude;
+    }
+
+    sandbox->busy = calloc(options->workers, sizeof(int));
+    if (!sandbox->busy) {
+        goto error;
+    }
+
+    sandbox->slot_bytes = SLOT_HEADER + 2 * (sizeof(struct ring) + options->ring_size);
+    sandbox->slot_bytes = (sandbox->slot_bytes + 4095) & ~(size_t) 4095;
+    sandbox->memory = mmap(NULL, sandbox->slot_bytes * options->workers, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sandbox->memory == MAP_FAILED) {
+        sandbox->memory = NULL;
+        goto error;
+    }
+    for (index = 0; index < options->workers; index++) {
+        get_request_ring(sandbox, index)->size = options->ring_size;
+        get_response_ring(sandbox, index)->size = options->ring_size;
+    }
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        goto error;
+    }
+    sandbox->zygote = fork();
+    if (sandbox->zygote == 0) {
+        close(fds[1]);
+        run_zygote(sandbox, fds[0]);
+    }
+    close(fds[0]);
+    if (sandbox->zygote < 0) {
+        close(fds[1]);
+        goto error;
+    }
+    sandbox->control = fds[1];
+
+    pthread_mutex_init(&sandbox->mutex, NULL);
+    sandbox->tenants[0].stats.weight = 1;
+    sandbox->tenant_count = 1;
+    for (index = 0; index < options->workers; index++) {
+        if (!spawn_worker(sandbox, index)) {
+            sandbox_close(sandbox);
+            return NULL;
+        }
+    }
+    return sandbox;
+
+error:
+    if (sandbox->memory) {
+        munmap(sandbox->memory, sandbox->slot_bytes * options->workers);
+    }
+    free(sandbox->busy);
+    free((char *) sandbox->options.prelude);
+    free(sandbox);
+    return NULL;
+}
+
+static void remove_pending(struct sandbox *sandbox, struct pending_call *call) {
+    struct pending_call **link = &sandbox->head, *previous = NULL;
+    while (*link != call) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    *link = call->next;
+    if (sandbox->tail == call) {
+        sandbox->tail = previous;
+    }
+}
+
+/* Returns the tenant called name, registering it if there is room; calls
+ * from tenants that do not fit are accounted to the default tenant. */
+static struct tenant *find_tenant(struct sandbox *sandbox, const char *name) {
+    int i;
+    if (!name) {
+        name = "";
+    }
+    for (i = 0; i < sandbox->tenant_count; i++) {
+        if (strncmp(sandbox->tenants[i].stats.name, name, SANDBOX_TENANT_NAME - 1) == 0) {
+            return &sandbox->tenants[i];
+        }
+    }
+    if (sandbox->tenant_count == SANDBOX_MAX_TENANTS) {
+        return &sandbox->tenants[0];
+    }
+
+    struct tenant *tenant = &sandbox->tenants[sandbox->tenant_count++];
+    memset(tenant, 0, sizeof(struct tenant));
+    strncpy(tenant->stats.name, name, SANDBOX_TENANT_NAME - 1);
+    tenant->stats.weight = 1;
+    tenant->usage = sandbox->usage_floor;
+    return tenant;
+}
+
+/* The next call to run: the most urgent priority first, then the tenant
+ * with the least weighted usage, then arrival order. */
+static struct pending_call *next_pending(struct sandbox *sandbox) {
+    struct pending_call *call, *best = sandbox->head;
+    for (call = sandbox->head; call; call = call->next) {
+        if (call->priority < best->priority
+                || (call->priority == best->priority && call->tenant->usage < best->tenant->usage)) {
+            best = call;
+        }
+    }
+    return best;
+}
+
+/* Takes an idle worker, queueing when there is none, at most until
+ * max_wait_ms has passed or the call's deadline (unless 0), whichever is
+ * sooner.  A tenant that was idle is lifted to the usage floor, so that it
+ * cannot bank credit while it is away; the floor follows the usage of the
+ * tenant served last. */
+static enum sandbox_status acquire_worker(struct sandbox *sandbox, int priority, const char *tenant_name,
+        double call_deadline, struct tenant **tenant, int *index) {
+    struct pending_call call = {.index = -1, .priority = priority, .next = NULL};
+    enum sandbox_status status = SANDBOX_OK;
+    double started = monotonic_seconds();
+
+    pthread_mutex_lock(&sandbox->mutex);
+    call.tenant = *tenant = find_tenant(sandbox, tenant_name);
+    if (call.tenant->usage < sandbox->usage_floor) {
+        call.tenant->usage = sandbox->usage_floor;
+    }
+    if (!sandbox->head) {
+        for (call.index = 0; call.index < sandbox->options.workers && sandbox->busy[call.index]; call.index++);
+        if (call.index == sandbox->options.workers) {
+            call.index = -1;
+        }
+    }
+
+    if (sandbox->dead == sandbox->options.workers) {
+        errno = ECHILD;
+        status = SANDBOX_SYSTEM_ERROR;
+    } else if (call.index < 0 && sandbox->options.max_queue > 0
+            && sandbox->stats.queued >= sandbox->options.max_queue) {
+        status = SANDBOX_OVERLOADED;
+    } else if (call.index < 0) {
+        pthread_condattr_t attr;
+        struct timespec deadline;
+        enum sandbox_status expired = SANDBOX_OVERLOADED;
+        int bounded = sandbox->options.max_wait_ms > 0;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&call.ready, &attr);
+        pthread_condattr_destroy(&attr);
+        if (sandbox->options.max_wait_ms > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += sandbox->options.max_wait_ms / 1000;
+            deadline.tv_nsec += (sandbox->options.max_wait_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+        }
+        if (call_deadline > 0 && (!bounded || call_deadline < deadline.tv_sec + deadline.tv_nsec / 1e9)) {
+            deadline.tv_sec = (time_t) call_deadline;
+            deadline.tv_nsec = (long) ((call_deadline - deadline.tv_sec) * 1e9);
+            expired = SANDBOX_DEADLINE_EXCEEDED;
+            bounded = 1;
+        }
+
+        if (sandbox->tail) {
+            sandbox->tail->next = &call;
+        } else {
+            sandbox->head = &call;
+        }
+        sandbox->tail = &call;
+        sandbox->stats.queued++;
+        while (call.index < 0) {
+            if (sandbox->dead == sandbox->options.workers) {
+                remove_pending(sandbox, &call);
+                errno = ECHILD;
+                status = SANDBOX_SYSTEM_ERROR;
+                break;
+            } else if (!bounded) {
+                pthread_cond_wait(&call.ready, &sandbox->mutex);
+            } else if (pthread_cond_timedwait(&call.ready, &sandbox->mutex, &deadline) == ETIMEDOUT
+                    && call.index < 0) {
+                remove_pending(sandbox, &call);
+                status = expired;
+                break;
+            }
+        }
+        sandbox->stats.queued--;
+        pthread_cond_destroy(&call.ready);
+    }
+
+    if (status == SANDBOX_OK) {
+        double waited = monotonic_seconds() - started;
+        sandbox->busy[call.index] = 1;
+        sandbox->stats.calls++;
+        sandbox->stats.wait_seconds += waited;
+        if (waited > sandbox->stats.max_wait_seconds) {
+            sandbox->stats.max_wait_seconds = waited;
+        }
+        call.tenant->stats.calls++;
+        call.tenant->stats.wait_seconds += waited;
+        sandbox->usage_floor = call.tenant->usage;
+        *index = call.index;
+    } else {
+        sandbox->stats.rejected++;
+        call.tenant->stats.rejected++;
+    }
+    pthread_mutex_unlock(&sandbox->mutex);
+    return status;
+}
+
+/* Charges the finished call to its tenant and passes the worker on.  A
+ * dead worker, one that could not be replaced, stays busy for good; once
+ * every worker is dead the queued calls are woken to fail. */
+static void release_worker(struct sandbox *sandbox, int index, struct tenant *tenant, double cpu_seconds,
+        int dead) {
+    pthread_mutex_lock(&sandbox->mutex);
+    tenant->stats.cpu_seconds += cpu_seconds;
+    tenant->usage += cpu_seconds / tenant->stats.weight;
+
+    struct pending_call *call = sandbox->head && !dead ? next_pending(sandbox) : NULL;
+    if (dead) {
+        sandbox->dead++;
+        for (call = sandbox->head; call && sandbox->dead == sandbox->options.workers; call = call->next) {
+            pthread_cond_signal(&call->ready);
+        }
+    } else if (call) {
+        remove_pending(sandbox, call);
+        call->index = index;
+        pthread_cond_signal(&call->ready);
+    } else {
+        sandbox->busy[index] = 0;
+    }
+    pthread_mutex_unlock(&sandbox->mutex);
+}
+
+enum sandbox_status sandbox_call(struct sandbox *sandbox, const char *request, size_t length,
+        int timeout_ms, double deadline, int priority, const char *tenant_name, char **response,
+        size_t *response_length) {
+    struct tenant *tenant;
+    enum sandbox_status status;
+    int index;
+
+    *response = NULL;
+    if (priority < 0 || priority >= SANDBOX_PRIORITIES) {
+        errno = EINVAL;
+        return SANDBOX_SYSTEM_ERROR;
+    }
+    status = acquire_worker(sandbox, priority, tenant_name, deadline, &tenant, &index);
+    if (status != SANDBOX_OK) {
+        return status;
+    }
+    double started = monotonic_seconds();
+
+    struct slot *slot = get_slot(sandbox, index);
+    struct waiter waiter = {timeout_ms >= 0 ? monotonic_ms() + timeout_ms : 0, &slot->pid, sandbox->zygote};
+
+    status = write_message(get_request_ring(sandbox, index), request, length, &waiter);
+    if (status == SANDBOX_OK) {
+        status = read_message(get_response_ring(sandbox, index), response, response_length, &waiter);
+    }
+    /* A worker that died or overran never reported its CPU time, so the
+     * tenant is charged the wall-clock time it held the worker instead. */
+    double cpu_seconds = monotonic_seconds() - started;
+    if (status == SANDBOX_OK) {
+        if ((*response)[0] == 'E') {
+            status = SANDBOX_SCRIPT_ERROR;
+        }
+        memmove(*response, *response + 1, *response_length);
+        (*response_length)--;
+        cpu_seconds = __atomic_load_n(&slot->cpu_ns, __ATOMIC_ACQUIRE) / 1e9;
+    }
+
+    int dead = 0;
+    if (status == SANDBOX_TIMEOUT || status == SANDBOX_CRASHED
+            || __atomic_load_n(&slot->retiring, __ATOMIC_ACQUIRE)) {
+        dead = !spawn_worker(sandbox, index);
+        if (dead && status == SANDBOX_OK) {
+            status = SANDBOX_SYSTEM_ERROR;
+        }
+    }
+
+    release_worker(sandbox, index, tenant, cpu_seconds, dead);
+    return status;
+}
+
+int sandbox_set_weight(struct sandbox *sandbox, const char *tenant_name, double weight) {
+    if (!(weight > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&sandbox->mutex);
+    struct tenant *tenant = find_tenant(sandbox, tenant_name);
+    int found = tenant != &sandbox->tenants[0] || !tenant_name || !tenant_name[0];
+    if (found) {
+        /* keep the tenant's standing: rescale usage to the new weight */
+        tenant->usage = tenant->usage * tenant->stats.weight / weight;
+        tenant->stats.weight = weight;
+    }
+    pthread_mutex_unlock(&sandbox->mutex);
+    if (!found) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+int sandbox_tenant_stats(struct sandbox *sandbox, struct sandbox_tenant_stats *stats, int capacity) {
+    int i;
+    pthread_mutex_lock(&sandbox->mutex);
+    for (i = 0; i < sandbox->tenant_count && i < capacity; i++) {
+        stats[i] = sandbox->tenants[i].stats;
+    }
+    pthread_mutex_unlock(&sandbox->mutex);
+    return i;
+}
+
+void sandbox_stats(struct sandbox *sandbox, struct sandbox_stats *stats, int reset) {
+    pthread_mutex_lock(&sandbox->mutex);
+    *stats = sandbox->stats;
+    if (reset) {
+        int queued = sandbox->stats.queued;
+        memset(&sandbox->stats, 0, sizeof(sandbox->stats));
+        sandbox->stats.queued = queued;
+    }
+    pthread_mutex_unlock(&sandbox->mutex);
+}
+
+void sandbox_close(struct sandbox *sandbox) {
+    if (sandbox->control >= 0) {
+        close(sandbox->control);
+    }
+    if (sandbox->zygote > 0) {
+        waitpid(sandbox->zygote, NULL, 0);
+    }
+    munmap(sandbox->memory, sandbox->slot_bytes * sandbox->options.workers);
+    pthread_mutex_destroy(&sandbox->mutex);
+    free(sandbox->busy);
+    free((char *) sandbox->options.prelude);
+    free(sandbox);
+}
@@ -0,0 +1,130 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef SPINDLY_SANDBOX_H
+#define SPINDLY_SANDBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A pool of pre-forked worker processes that run scripts in isolation.
+ * Workers are forked from a small zygote process that is itself forked
+ * once when the pool opens, so that replacing a worker never forks the
+ * (large, threaded) host process.  Every worker owns a slot of shared
+ * memory holding a request ring and a response ring, signalled through
+ * futexes.  Workers warm up (engine initialized, prelude compiled) before
+ * taking requests, and retire after max_calls requests or once their
+ * resident set exceeds max_rss bytes; the zygote then forks a replacement.
+ * A worker that cannot be replaced (say the zygote has died) leaves the
+ * pool, and once none is left every call fails with SANDBOX_SYSTEM_ERROR
+ * and errno ECHILD.
+ * Calls that find every worker busy queue; max_queue and max_wait_ms (when
+ * non-zero) bound how many may queue and for how long, and calls past
+ * either limit are rejected as overloaded.  A call whose deadline passes
+ * while it is queued is dropped from the queue as well.
+ *
+ * Every call has a priority class (0 is the most urgent) and a tenant.  A
+ * free worker goes to the most urgent queued class, and within it to the
+ * tenant with the least worker CPU time per unit of weight, so that one
+ * busy tenant is throttled rather than starving the rest.
+ *
+ * Payloads are ASCII JSON.  A request is an object with script, params and
+ * timeout (seconds) members; a successful response holds the JSON of the
+ * result.  This file does not depend on Python. */
+
+#define SANDBOX_PRIORITIES 3
+#define SANDBOX_MAX_TENANTS 64
+#define SANDBOX_TENANT_NAME 64
+
+struct sandbox_options {
+    int workers;
+    uint32_t ring_size;
+    unsigned long max_calls;
+    size_t max_rss;
+    const char *prelude;
+    size_t prelude_length;
+    int max_queue;
+    int max_wait_ms;
+};
+
+enum sandbox_status {
+    SANDBOX_OK = 0,
+    SANDBOX_SCRIPT_ERROR,
+    SANDBOX_TIMEOUT,
+    SANDBOX_CRASHED,
+    SANDBOX_OVERLOADED,
+    SANDBOX_DEADLINE_EXCEEDED,
+    SANDBOX_SYSTEM_ERROR
+};
+
+/* Admission counters.  queued is the current queue depth; the wait times
+ * cover admitted calls, from sandbox_call until a worker was free. */
+struct sandbox_stats {
+    unsigned long calls;
+    unsigned long rejected;
+    int queued;
+    double wait_seconds;
+    double max_wait_seconds;
+};
+
+/* Per-tenant counters.  The tenant named "" takes calls without a tenant,
+ * and those of tenants past SANDBOX_MAX_TENANTS. */
+struct sandbox_tenant_stats {
+    char name[SANDBOX_TENANT_NAME];
+    double weight;
+    unsigned long calls;
+    unsigned long rejected;
+    double cpu_seconds;
+    double wait_seconds;
+};
+
+struct sandbox;
+
+/* Returns NULL and sets errno on failure.  prelude is an ASCII JSON array
+ * of sources and is copied. */
+struct sandbox *sandbox_open(const struct sandbox_options *options);
+
+/* Sends one request to an idle worker, waiting for one if all are busy,
+ * and waits at most timeout_ms (unless negative) for its response.  A
+ * non-zero deadline (CLOCK_MONOTONIC seconds) bounds the wait for a worker;
+ * the request carries its own deadline for the worker to enforce.  tenant
+ * may be NULL.  On
+ * SANDBOX_OK the result JSON, and on SANDBOX_SCRIPT_ERROR the error
+ * message, is returned in a malloc'd, NUL-terminated *response.  A worker that crashes or overruns
+ * its timeout is killed and replaced.  Safe to call from several threads. */
+enum sandbox_status sandbox_call(struct sandbox *sandbox, const char *request, size_t length,
+    int timeout_ms, double deadline, int priority, const char *tenant, char **response,
+    size_t *response_length);
+
+void sandbox_stats(struct sandbox *sandbox, struct sandbox_stats *stats, int reset);
+
+/* Tenants weigh 1 until given another (positive) weight. */
+int sandbox_set_weight(struct sandbox *sandbox, const char *tenant, double weight);
+
+/* Copies out the counters of at most capacity tenants; returns how many. */
+int sandbox_tenant_stats(struct sandbox *sandbox, struct sandbox_tenant_stats *stats, int capacity);
+
+void sandbox_close(struct sandbox *sandbox);
+
+/* The evaluation engine behind each worker, also used by spindlyd: one
+ * runtime whose global holds the prelude, and a cache of compiled scripts.
+ * An engine may be used from any thread, one thread at a time. */
+struct sandbox_engine;
+
+struct sandbox_engine *sandbox_engine_open(const char *prelude, size_t length);
+
+/* Runs one request.  The response is 'R' followed by the result JSON, or
+ * 'E' followed by an error message, and stays valid until the next call. */
+const char *sandbox_engine_run(struct sandbox_engine *engine, const char *request, size_t length,
+    size_t *response_length);
+
+/* Interrupts the request the engine is running, if any; the request then
+ * fails with "cancelled".  Safe to call from any thread. */
+void sandbox_engine_cancel(struct sandbox_engine *engine);
+
+void sandbox_engine_stats(struct sandbox_engine *engine, unsigned long *hits, unsigned long *misses);
+
+void sandbox_engine_close(struct sandbox_engine *engine);
+
+#endif
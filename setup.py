@@ -1,11 +1,39 @@
-from distutils.core import setup, Extension
+from distutils.ccompiler import new_compiler
+from distutils.core import setup, Command, Extension
+from distutils.sysconfig import customize_compiler
+
+libraries = ['mozjs185', 'pthread', 'stdc++']
+include_dirs = ['/usr/local/include/js', '/usr/include/js']
 
 module = Extension('spindly',
-    libraries=['mozjs185', 'pthread'],
-    include_dirs=['/usr/local/include/js', '/usr/include/js'],
-    sources=['spindly.c'])
+    libraries=libraries,
+    include_dirs=include_dirs,
+    sources=['spindly.c', 'typedarray.cpp', 'sandbox.c', 'frames.c'])
+
+
+class build_spindlyd(Command):
+    """Builds the spindlyd evaluation daemon from the extension's sources."""
+
+    description = 'build the spindlyd daemon'
+    user_options = [('build-dir=', 'b', 'directory to put the binary in')]
+
+    def initialize_options(self):
+        self.build_dir = None
+
+    def finalize_options(self):
+        if self.build_dir is None:
+            self.build_dir = '.'
+
+    def run(self):
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        objects = compiler.compile(['spindlyd.c', 'sandbox.c', 'frames.c'],
+            output_dir='build', include_dirs=include_dirs, extra_preargs=['-std=gnu99'])
+        compiler.link_executable(objects, 'spindlyd', output_dir=self.build_dir, libraries=libraries)
+
 
 setup(
     name='spindly',
     version='0.0.1',
-    ext_modules=[module])
+    ext_modules=[module],
+    cmdclass={'build_spindlyd': build_spindlyd})
@@ -3,344 +3,4024 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include <Python.h>
+#include <structmember.h>
+#include <pythread.h>
 #include <datetime.h>
+#include <limits.h>
 #include <sys/poll.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <jsapi.h>
 
+#include "frames.h"
+#include "sandbox.h"
+#include "typedarray.h"
+
+/* Standard classes are defined on a global the first time a script names
+ * them, rather than all up front, so that creating a global stays cheap. */
+static JSBool resolve_global(JSContext *context, JSObject *obj, jsid id, uintN flags, JSObject **objp) {
+    JSBool resolved;
+    if (!JS_ResolveStandardClass(context, obj, id, &resolved)) {
+        return JS_FALSE;
+    }
+    *objp = resolved ? obj : NULL;
+    return JS_TRUE;
+}
+
+static JSBool enumerate_global(JSContext *context, JSObject *obj) {
+    return JS_EnumerateStandardClasses(context, obj);
+}
+
 static JSClass global_class = {
     .name = "global",
-    .flags = JSCLASS_GLOBAL_FLAGS,
+    .flags = JSCLASS_GLOBAL_FLAGS | JSCLASS_NEW_RESOLVE,
     .addProperty = JS_PropertyStub,
     .delProperty = JS_PropertyStub,
     .getProperty = JS_PropertyStub,
-    .setProperty = JS_PropertyStub,
-    .enumerate = JS_EnumerateStub,
-    .resolve = JS_ResolveStub,
+    .setProperty = JS_StrictPropertyStub,
+    .enumerate = enumerate_global,
+    .resolve = (JSResolveOp) resolve_global,
     .convert = JS_ConvertStub,
     .finalize = JS_FinalizeStub,
     JSCLASS_NO_OPTIONAL_MEMBERS
 };
 
+/* Per-call state, reachable through the context private. */
+struct host_function {
+    JSObject *object;
+    PyObject *callable;
+};
+
+struct evaluation {
+    const char *script;
+    Py_ssize_t script_length;
+    PyObject *params;
+    PyObject *functions;
+    PyObject *emit;
+    struct host_function *hosts;
+    Py_ssize_t host_count;
+    int timeout;
+    double deadline;
+    volatile double expires;
+    uint32 jit;
+    int error;
+    int numpy;
+    Py_ssize_t max_depth;
+    Py_ssize_t max_nodes;
+    volatile int cancelled;
+};
+
+#define DEFAULT_MAX_DEPTH 1000000
+
+/* Scripts run with the GIL released, so the reporter takes it back itself. */
 void raise_python_exception(JSContext *context, const char *message, JSErrorReport *report) {
+    PyGILState_STATE state = PyGILState_Ensure();
     if (!report->filename) {
         PyErr_Format(PyExc_ValueError, "%s", message);
     } else {
         PyErr_Format(PyExc_ValueError, "%s:%u:%s", report->filename,
             (unsigned int) report->lineno, message);
     }
+    PyGILState_Release(state);
+
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    evaluation->error = 1;
+}
+
+/* Dict keys seen by a runtime are cached as ids, so repeated schemas skip
+ * atomization entirely.  The engine pins interned strings until the runtime
+ * is destroyed, which keeps the cached ids valid for the cache's lifetime. */
+#define ATOM_CACHE_LIMIT 4096
+
+struct runtime_data {
+    PyObject *atoms;
+    PyObject *keys;
+    PyObject *to_javascript_memo;
+    PyObject *to_python_memo;
+    JSObject *visited;
+    jsint visited_count;
+    jsval *roots;
+    size_t root_count;
+    size_t root_capacity;
+};
+
+/* Values on the root stack are traced by the GC; conversions reserve slots on
+ * it for intermediate vectors that live on the heap, out of reach of the
+ * conservative stack scanner. */
+static void trace_runtime_data(JSTracer *tracer, void *ptr) {
+    struct runtime_data *data = ptr;
+    size_t i;
+    for (i = 0; i < data->root_count; i++) {
+        JS_CALL_VALUE_TRACER(tracer, data->roots[i], "spindly root");
+    }
+}
+
+static struct runtime_data *new_runtime_data(JSRuntime *runtime) {
+    struct runtime_data *data = calloc(sizeof(struct runtime_data), 1);
+    if (!data) {
+        return NULL;
+    }
+    data->atoms = PyDict_New();
+    if (!data->atoms) {
+        free(data);
+        return NULL;
+    }
+    JS_SetRuntimePrivate(runtime, data);
+    JS_SetExtraGCRoots(runtime, trace_runtime_data, data);
+    return data;
+}
+
+static void free_runtime_data(JSRuntime *runtime) {
+    struct runtime_data *data = JS_GetRuntimePrivate(runtime);
+    if (data) {
+        JS_SetExtraGCRoots(runtime, NULL, NULL);
+        Py_XDECREF(data->atoms);
+        free(data->roots);
+        free(data);
+        JS_SetRuntimePrivate(runtime, NULL);
+    }
+}
 
-    int *error = JS_GetContextPrivate(context);
-    *error = 1;
+static struct runtime_data *get_runtime_data(JSContext *context) {
+    return JS_GetRuntimePrivate(JS_GetRuntime(context));
 }
 
-static jsval to_javascript_object(JSContext *context, PyObject *value);
-static PyObject *to_python_object(JSContext *context, jsval value);
+static JSBool reserve_roots(JSContext *context, size_t count, size_t *base) {
+    struct runtime_data *data = get_runtime_data(context);
+    size_t needed = data->root_count + count;
+    size_t i;
 
-void populate_javascript_object(JSContext *context, JSObject *obj, PyObject *dict) {
-    char *propname;
-    PyObject *key, *value;
-    Py_ssize_t pos = 0;
-    while (PyDict_Next(dict, &pos, &key, &value)) {
-        PyObject *str = NULL;
-        propname = NULL;
-        if (PyString_Check(key)) {
-            propname = PyString_AsString(key);
-        } else if (PyUnicode_Check(key)) {
-            PyObject *str = PyUnicode_AsUTF8String(key);
-            propname = PyString_AsString(str);
-            Py_DECREF(str);
+    if (needed > data->root_capacity) {
+        size_t capacity = data->root_capacity ? data->root_capacity : 64;
+        while (capacity < needed) {
+            capacity *= 2;
         }
-        if (propname != NULL) {
-            jsval item = to_javascript_object(context, value);
-            JS_SetProperty(context, obj, propname, &item);
+        jsval *roots = realloc(data->roots, capacity * sizeof(jsval));
+        if (!roots) {
+            PyErr_NoMemory();
+            return JS_FALSE;
         }
+        data->roots = roots;
+        data->root_capacity = capacity;
     }
-}
 
-static jsval to_javascript_object(JSContext *context, PyObject *value) {
-    if (PyString_Check(value)) {
-        JSString *obj = JS_NewStringCopyN(context, PyString_AsString(value), PyString_Size(value));
-        return STRING_TO_JSVAL(obj);
-    } else if (PyUnicode_Check(value)) {
-        PyObject *encoded = PyUnicode_AsUTF8String(value);
-        JSString *obj = JS_NewStringCopyN(context, PyString_AsString(encoded), PyString_Size(encoded));
-        Py_DECREF(encoded);
-        return STRING_TO_JSVAL(obj);
-    } else if (PyFloat_Check(value)) {
-        return DOUBLE_TO_JSVAL(PyFloat_AsDouble(value));
-    } else if (PyInt_Check(value)) {
-        return INT_TO_JSVAL(PyInt_AsLong(value));
-    } else if (PyLong_Check(value)) {
-        return INT_TO_JSVAL(PyLong_AsLong(value));
-    } else if (PyList_Check(value)) {
-        JSObject *obj = JS_NewArrayObject(context, 0, NULL);
-        int i;
-        for (i = 0; i < PyList_Size(value); i++) {
-            jsval item = to_javascript_object(context, PyList_GetItem(value, i));
-            JS_SetElement(context, obj, i, &item);
-        }
-        return OBJECT_TO_JSVAL(obj);
-    } else if (PyTuple_Check(value)) {
-        JSObject *obj = JS_NewArrayObject(context, 0, NULL);
-        int i;
-        for (i = 0; i < PyTuple_Size(value); i++) {
-            jsval item = to_javascript_object(context, PyTuple_GetItem(value, i));
-            JS_SetElement(context, obj, i, &item);
-        }
-        return OBJECT_TO_JSVAL(obj);
-    } else if (PyDict_Check(value)) {
-        JSObject *obj = JS_NewObject(context, NULL, NULL, NULL);
-        populate_javascript_object(context, obj, value);
-        return OBJECT_TO_JSVAL(obj);
-    } else if (PyDateTime_Check(value)) {
-        JSObject *obj = JS_NewDateObject(context,
-            PyDateTime_GET_YEAR(value),
-            PyDateTime_GET_MONTH(value) - 1,
-            PyDateTime_GET_DAY(value),
-            PyDateTime_DATE_GET_HOUR(value),
-            PyDateTime_DATE_GET_MINUTE(value),
-            PyDateTime_DATE_GET_SECOND(value));
-        return OBJECT_TO_JSVAL(obj);
-    } else {
-        return JSVAL_NULL;
+    for (i = data->root_count; i < needed; i++) {
+        data->roots[i] = JSVAL_VOID;
     }
+    *base = data->root_count;
+    data->root_count = needed;
+    return JS_TRUE;
 }
 
-static PyObject *to_python_datetime(JSContext *context, JSObject *obj) {
-    jsval year, month, day, hour, minute, second;
-    if (!JS_CallFunctionName(context, obj, "getFullYear", 0, NULL, &year)) {
-        return NULL;
+static void release_roots(JSContext *context, size_t base) {
+    get_runtime_data(context)->root_count = base;
+}
+
+/* Integer keys become index ids, as JS gives them back to Python, and
+ * strings become (mostly interned) atoms. */
+static JSBool key_to_id(JSContext *context, PyObject *key, jsid *id) {
+    if (PyInt_Check(key) || PyLong_Check(key)) {
+        long index = PyLong_AsLong(key);
+        if (index >= 0 && index <= JSID_INT_MAX) {
+            *id = INT_TO_JSID((jsint) index);
+            return JS_TRUE;
+        }
+        PyErr_Clear();
+        PyObject *text = PyObject_Str(key);
+        if (!text) {
+            return JS_FALSE;
+        }
+        JSBool ok = key_to_id(context, text, id);
+        Py_DECREF(text);
+        return ok;
     }
-    if (!JS_CallFunctionName(context, obj, "getMonth", 0, NULL, &month)) {
-        return NULL;
+
+    struct runtime_data *data = get_runtime_data(context);
+    PyObject *cached = PyDict_GetItem(data->atoms, key);
+    if (cached != NULL) {
+        *id = (jsid) PyLong_AsVoidPtr(cached);
+        return JS_TRUE;
     }
-    if (!JS_CallFunctionName(context, obj, "getDate", 0, NULL, &day)) {
-        return NULL;
+
+    PyObject *encoded;
+    if (PyString_Check(key)) {
+        Py_INCREF(key);
+        encoded = key;
+    } else {
+        encoded = PyUnicode_AsUTF8String(key);
+        if (!encoded) {
+            return JS_FALSE;
+        }
     }
-    if (!JS_CallFunctionName(context, obj, "getHours", 0, NULL, &hour)) {
-        return NULL;
+
+    int cacheable = PyDict_Size(data->atoms) < ATOM_CACHE_LIMIT;
+    JSString *atom;
+    if (cacheable) {
+        atom = JS_InternStringN(context, PyString_AS_STRING(encoded), PyString_GET_SIZE(encoded));
+    } else {
+        atom = JS_NewStringCopyN(context, PyString_AS_STRING(encoded), PyString_GET_SIZE(encoded));
     }
-    if (!JS_CallFunctionName(context, obj, "getMinutes", 0, NULL, &minute)) {
-        return NULL;
+    Py_DECREF(encoded);
+    if (!atom || !JS_ValueToId(context, STRING_TO_JSVAL(atom), id)) {
+        return JS_FALSE;
     }
-    if (!JS_CallFunctionName(context, obj, "getSeconds", 0, NULL, &second)) {
-        return NULL;
+
+    if (cacheable) {
+        PyObject *value = PyLong_FromVoidPtr((void *) *id);
+        if (!value) {
+            return JS_FALSE;
+        }
+        Py_INCREF(key);
+        if (PyString_CheckExact(key)) {
+            PyString_InternInPlace(&key);
+        }
+        int status = PyDict_SetItem(data->atoms, key, value);
+        Py_DECREF(key);
+        Py_DECREF(value);
+        if (status < 0) {
+            return JS_FALSE;
+        }
     }
-    return PyDateTime_FromDateAndTime(JSVAL_TO_INT(year), JSVAL_TO_INT(month) + 1,
-        JSVAL_TO_INT(day), JSVAL_TO_INT(hour), JSVAL_TO_INT(minute),
-        JSVAL_TO_INT(second), 0);
+    return JS_TRUE;
 }
 
-static PyObject *to_python_list(JSContext *context, JSObject *obj) {
-    PyObject *list = PyList_New(0);
-    size_t length, i;
-    jsval item;
-    if (JS_GetArrayLength(context, obj, &length)) {
-        for (i = 0; i < length; i++) {
-            if (JS_GetElement(context, obj, i, &item)) {
-                PyObject *list_item = to_python_object(context, item);
-                PyList_Append(list, list_item);
-                Py_DECREF(list_item);
-            }
-        }
+static jsval long_to_jsval(long value) {
+    if (value == (jsint) value) {
+        return INT_TO_JSVAL((jsint) value);
     }
-    return list;
+    return DOUBLE_TO_JSVAL((jsdouble) value);
 }
 
-static PyObject *to_python_dict(JSContext *context, JSObject *obj) {
-    JSObject *iter = JS_NewPropertyIterator(context, obj);
-    if (iter) {
-        PyObject *dict = PyDict_New();
-        jsid propid;
-        while (JS_NextProperty(context, iter, &propid) == JS_TRUE) {
-            if (propid == JSID_VOID) {
-                break;
+/* Sequences made up only of floats or only of ints are converted in a tight
+ * loop without per-element dispatch.  Numbers are not GC things, so the
+ * vector does not need to be rooted. */
+static JSBool to_numeric_vector(PyObject **items, Py_ssize_t length, jsval *vector) {
+    Py_ssize_t i;
+    if (PyFloat_CheckExact(items[0])) {
+        for (i = 0; i < length; i++) {
+            if (!PyFloat_CheckExact(items[i])) {
+                return JS_FALSE;
             }
-            jsval key, value;
-            if (JS_IdToValue(context, propid, &key)) {
-                PyObject *pykey = to_python_object(context, key);
-                if (pykey != Py_None) {
-                    if (JS_GetPropertyById(context, obj, propid, &value)) {
-                        PyObject *pyvalue = to_python_object(context, value);
-                        PyDict_SetItem(dict, pykey, pyvalue);
-                        Py_DECREF(pykey);
-                        Py_DECREF(pyvalue);
-                    }
-                }
+            vector[i] = DOUBLE_TO_JSVAL(PyFloat_AS_DOUBLE(items[i]));
+        }
+        return JS_TRUE;
+    } else if (PyInt_CheckExact(items[0])) {
+        for (i = 0; i < length; i++) {
+            if (!PyInt_CheckExact(items[i])) {
+                return JS_FALSE;
             }
+            vector[i] = long_to_jsval(PyInt_AS_LONG(items[i]));
         }
-        return dict;
-    } else {
-        Py_INCREF(Py_None);
-        return Py_None;
+        return JS_TRUE;
     }
+    return JS_FALSE;
 }
 
-static PyObject *to_python_object(JSContext *context, jsval value) {
-    if (JSVAL_IS_PRIMITIVE(value)) {
-        if (JSVAL_IS_STRING(value)) {
-            return PyUnicode_FromString(JS_EncodeString(context, JSVAL_TO_STRING(value)));
-        } else if (JSVAL_IS_BOOLEAN(value)) {
-            return PyBool_FromLong(JSVAL_TO_BOOLEAN(value));
-        } else if (JSVAL_IS_INT(value)) {
-            return PyLong_FromLong(JSVAL_TO_INT(value));
-        } else if (JSVAL_IS_DOUBLE(value)) {
-            return PyFloat_FromDouble(JSVAL_TO_DOUBLE(value));
-        } else {
-            Py_INCREF(Py_None);
-            return Py_None;
+/* Conversions in both directions keep an identity memo, so shared
+ * references stay shared, cycles are preserved and every container is
+ * converted once.  Containers register themselves before their children are
+ * converted. */
+static JSBool remember_javascript_object(JSContext *context, PyObject *value, JSObject *obj) {
+    struct runtime_data *data = get_runtime_data(context);
+    PyObject *key = PyLong_FromVoidPtr(value);
+    PyObject *target = PyLong_FromVoidPtr(obj);
+    int status = -1;
+    if (key && target) {
+        status = PyDict_SetItem(data->to_javascript_memo, key, target);
+    }
+    Py_XDECREF(key);
+    Py_XDECREF(target);
+    return status == 0;
+}
+
+static JSObject *find_javascript_object(JSContext *context, PyObject *value) {
+    struct runtime_data *data = get_runtime_data(context);
+    PyObject *key = PyLong_FromVoidPtr(value);
+    if (!key) {
+        PyErr_Clear();
+        return NULL;
+    }
+    PyObject *target = PyDict_GetItem(data->to_javascript_memo, key);
+    Py_DECREF(key);
+    return target ? PyLong_AsVoidPtr(target) : NULL;
+}
+
+static int is_container(PyObject *value) {
+    return PyList_Check(value) || PyTuple_Check(value) || PyDict_Check(value);
+}
+
+static PyObject *array_type = NULL;
+
+/* How buffer items are stored into a typed array.  JS has no 64-bit integer
+ * arrays, so int64 data is widened into a Float64Array like any JS number. */
+enum {
+    COPY_RAW = 0,
+    COPY_INT64,
+    COPY_UINT64
+};
+
+struct buffer_layout {
+    int type;
+    int copy;
+};
+
+#if PY_LITTLE_ENDIAN
+#define NATIVE_BYTE_ORDER '<'
+#else
+#define NATIVE_BYTE_ORDER '>'
+#endif
+
+static int layout_for_kind(char kind, Py_ssize_t itemsize, struct buffer_layout *layout) {
+    layout->copy = COPY_RAW;
+    switch (kind) {
+    case 'f':
+        layout->type = itemsize == 4 ? TYPED_ARRAY_FLOAT32 : TYPED_ARRAY_FLOAT64;
+        return itemsize == 4 || itemsize == 8;
+    case 'b':
+        layout->type = TYPED_ARRAY_UINT8;
+        return itemsize == 1;
+    case 'i':
+        switch (itemsize) {
+        case 1:
+            layout->type = TYPED_ARRAY_INT8;
+            return 1;
+        case 2:
+            layout->type = TYPED_ARRAY_INT16;
+            return 1;
+        case 4:
+            layout->type = TYPED_ARRAY_INT32;
+            return 1;
+        case 8:
+            layout->type = TYPED_ARRAY_FLOAT64;
+            layout->copy = COPY_INT64;
+            return 1;
         }
-    } else {
-        JSObject *obj = JSVAL_TO_OBJECT(value);
-        if (JS_ObjectIsDate(context, obj)) {
-            return to_python_datetime(context, obj);
-        } else if (JS_IsArrayObject(context, obj)) {
-            return to_python_list(context, obj);
-        } else {
-            return to_python_dict(context, obj);
+        return 0;
+    case 'u':
+        switch (itemsize) {
+        case 1:
+            layout->type = TYPED_ARRAY_UINT8;
+            return 1;
+        case 2:
+            layout->type = TYPED_ARRAY_UINT16;
+            return 1;
+        case 4:
+            layout->type = TYPED_ARRAY_UINT32;
+            return 1;
+        case 8:
+            layout->type = TYPED_ARRAY_FLOAT64;
+            layout->copy = COPY_UINT64;
+            return 1;
         }
+        return 0;
     }
+    return 0;
 }
 
-struct watchdog {
-    pthread_t tid;
-    JSContext *context;
-    int timeout;
-    int pipe[2];
-};
+/* Picks the typed array for a struct-module format such as numpy emits. */
+static int format_to_layout(const char *format, Py_ssize_t itemsize, struct buffer_layout *layout) {
+    if (format == NULL) {
+        return layout_for_kind('u', 1, layout);
+    }
+    if (*format == '@' || *format == '=' || *format == NATIVE_BYTE_ORDER) {
+        format++;
+    }
+    if (format[0] == '\0' || format[1] != '\0') {
+        return 0;
+    }
+    switch (*format) {
+    case 'f':
+    case 'd':
+        return layout_for_kind('f', itemsize, layout);
+    case '?':
+        return layout_for_kind('b', itemsize, layout);
+    case 'c':
+        return layout_for_kind('u', itemsize, layout);
+    case 'b':
+    case 'h':
+    case 'i':
+    case 'l':
+    case 'q':
+        return layout_for_kind('i', itemsize, layout);
+    case 'B':
+    case 'H':
+    case 'I':
+    case 'L':
+    case 'Q':
+        return layout_for_kind('u', itemsize, layout);
+    }
+    return 0;
+}
 
-JSBool js_destroy(JSContext *context) {
-    JS_SetPendingException(context, STRING_TO_JSVAL(JS_NewStringCopyZ(context, "timeout")));
-    return JS_FALSE;
+/* Same, for an __array_interface__ typestr such as "<f8". */
+static int typestr_to_layout(const char *typestr, struct buffer_layout *layout) {
+    if (typestr[0] != '|' && typestr[0] != NATIVE_BYTE_ORDER) {
+        return 0;
+    }
+    return layout_for_kind(typestr[1], atoi(typestr + 2), layout);
 }
 
-void *js_watchdog(void *ptr) {
-    struct watchdog *wd = (struct watchdog *) ptr;
-    struct pollfd poller;
+/* Bytes per source item; 64-bit integers land in float64 arrays. */
+static size_t layout_item_size(struct buffer_layout *layout) {
+    return layout->copy == COPY_RAW ? typed_array_item_size(layout->type) : 8;
+}
 
-    poller.fd = wd->pipe[1];
-    poller.events = POLLIN;
+static JSBool copy_to_typed_array(JSContext *context, struct buffer_layout *layout,
+        const void *bytes, Py_ssize_t size, jsval *rval) {
+    size_t itemsize = layout_item_size(layout);
+    Py_ssize_t length = size / itemsize;
+    Py_ssize_t i;
+    void *data;
 
-    int retval = poll(&poller, 1, wd->timeout * 1000);
-    if (retval <= 0) {
-        JS_TriggerOperationCallback(wd->context);
+    if (length != (jsint) length) {
+        PyErr_Format(PyExc_ValueError, "buffer too large for a typed array");
+        return JS_FALSE;
     }
-    return NULL;
+    JSObject *obj = new_typed_array(context, layout->type, (jsuint) length, &data);
+    if (!obj) {
+        return JS_FALSE;
+    }
+    switch (layout->copy) {
+    case COPY_INT64:
+        for (i = 0; i < length; i++) {
+            ((jsdouble *) data)[i] = (jsdouble) ((const int64_t *) bytes)[i];
+        }
+        break;
+    case COPY_UINT64:
+        for (i = 0; i < length; i++) {
+            ((jsdouble *) data)[i] = (jsdouble) ((const uint64_t *) bytes)[i];
+        }
+        break;
+    default:
+        memcpy(data, bytes, length * itemsize);
+    }
+    *rval = OBJECT_TO_JSVAL(obj);
+    return JS_TRUE;
 }
 
-struct watchdog *run_watchdog(JSContext *context, int timeout) {
-    struct watchdog *wd;
+/* Objects that publish only __array_interface__ are read in place when their
+ * data is contiguous. */
+static JSBool interface_to_typed_array(JSContext *context, PyObject *value, jsval *rval) {
+    PyObject *interface = PyObject_GetAttrString(value, "__array_interface__");
+    if (!interface) {
+        return JS_FALSE;
+    }
 
-    wd = calloc(sizeof(struct watchdog), 1);
-    if (!wd) {
-        return NULL;
+    JSBool ok = JS_FALSE;
+    PyObject *typestr = PyDict_Check(interface) ? PyDict_GetItemString(interface, "typestr") : NULL;
+    PyObject *data = PyDict_Check(interface) ? PyDict_GetItemString(interface, "data") : NULL;
+    PyObject *shape = PyDict_Check(interface) ? PyDict_GetItemString(interface, "shape") : NULL;
+    PyObject *strides = PyDict_Check(interface) ? PyDict_GetItemString(interface, "strides") : NULL;
+    struct buffer_layout layout;
+
+    if (!typestr || !PyString_Check(typestr) || !data || !PyTuple_Check(data) ||
+            PyTuple_GET_SIZE(data) < 1 || !shape || !PyTuple_Check(shape)) {
+        PyErr_Format(PyExc_TypeError, "malformed __array_interface__");
+    } else if (strides && strides != Py_None) {
+        PyErr_Format(PyExc_TypeError, "non-contiguous __array_interface__ is not supported");
+    } else if (!typestr_to_layout(PyString_AS_STRING(typestr), &layout)) {
+        PyErr_Format(PyExc_TypeError, "unsupported array type '%s'", PyString_AS_STRING(typestr));
+    } else {
+        void *bytes = PyLong_AsVoidPtr(PyTuple_GET_ITEM(data, 0));
+        Py_ssize_t size = layout_item_size(&layout);
+        Py_ssize_t i;
+        for (i = 0; i < PyTuple_GET_SIZE(shape) && !PyErr_Occurred(); i++) {
+            Py_ssize_t dimension = PyInt_AsSsize_t(PyTuple_GET_ITEM(shape, i));
+            if (dimension == -1 && PyErr_Occurred()) {
+                break;
+            } else if (dimension < 0) {
+                PyErr_Format(PyExc_ValueError, "negative dimension in __array_interface__ shape");
+            } else if (dimension > 0 && size > PY_SSIZE_T_MAX / dimension) {
+                PyErr_Format(PyExc_ValueError, "__array_interface__ shape is too large");
+            } else {
+                size *= dimension;
+            }
+        }
+        if (!PyErr_Occurred()) {
+            ok = copy_to_typed_array(context, &layout, bytes, size, rval);
+        }
     }
+    Py_DECREF(interface);
+    return ok;
+}
 
-    wd->context = context;
-    if (pipe(wd->pipe) < 0) {
-        free(wd);
-        return NULL;
+/* Buffer-protocol objects become typed arrays.  ArrayBuffers in 1.8.5 always
+ * own their storage, so the contents are copied once, straight from the
+ * Python buffer into the array. */
+static JSBool buffer_to_typed_array(JSContext *context, PyObject *value, jsval *rval) {
+    if (PyObject_CheckBuffer(value)) {
+        Py_buffer view;
+        if (PyObject_GetBuffer(value, &view, PyBUF_FULL_RO) < 0) {
+            return JS_FALSE;
+        }
+        struct buffer_layout layout;
+        if (!format_to_layout(view.format, view.itemsize, &layout)) {
+            PyErr_Format(PyExc_TypeError, "unsupported buffer format '%s'", view.format);
+            PyBuffer_Release(&view);
+            return JS_FALSE;
+        }
+
+        JSBool ok;
+        if (PyBuffer_IsContiguous(&view, 'C')) {
+            ok = copy_to_typed_array(context, &layout, view.buf, view.len, rval);
+        } else {
+            void *bytes = PyMem_Malloc(view.len);
+            if (!bytes) {
+                PyBuffer_Release(&view);
+                PyErr_NoMemory();
+                return JS_FALSE;
+            }
+            ok = PyBuffer_ToContiguous(bytes, &view, view.len, 'C') == 0 &&
+                copy_to_typed_array(context, &layout, bytes, view.len, rval);
+            PyMem_Free(bytes);
+        }
+        PyBuffer_Release(&view);
+        return ok;
     }
 
-    wd->timeout = timeout;
-    if (pthread_create(&wd->tid, NULL, js_watchdog, wd) != 0) {
-        close(wd->pipe[0]);
-        close(wd->pipe[1]);
-        free(wd);
-        return NULL;
+    const void *bytes;
+    Py_ssize_t size;
+    if (PyObject_AsReadBuffer(value, &bytes, &size) < 0) {
+        return JS_FALSE;
     }
-    return wd;
-}
 
-void shutdown_watchdog(struct watchdog *wd) {
-    close(wd->pipe[0]);
-    close(wd->pipe[1]);
-    (void) pthread_join(wd->tid, NULL);
-    free(wd);
+    struct buffer_layout layout;
+    format_to_layout(NULL, 1, &layout);
+    if (PyObject_TypeCheck(value, (PyTypeObject *) array_type)) {
+        PyObject *typecode = PyObject_GetAttrString(value, "typecode");
+        PyObject *itemsize = PyObject_GetAttrString(value, "itemsize");
+        int known = 0;
+        if (typecode && itemsize && PyString_Check(typecode)) {
+            known = format_to_layout(PyString_AS_STRING(typecode), PyInt_AsLong(itemsize), &layout);
+            if (!known) {
+                PyErr_Format(PyExc_TypeError, "unsupported array typecode '%s'",
+                    PyString_AS_STRING(typecode));
+            }
+        }
+        Py_XDECREF(typecode);
+        Py_XDECREF(itemsize);
+        if (!known) {
+            return JS_FALSE;
+        }
+    }
+    return copy_to_typed_array(context, &layout, bytes, size, rval);
 }
 
-void shutdown(JSRuntime *runtime, JSContext *context) {
-    JS_DestroyContext(context);
-    JS_DestroyRuntime(runtime);
-    JS_ShutDown();
+/* Conversions walk containers with an explicit work stack rather than C
+ * recursion, so deep data is bounded by max_depth instead of by the C stack.
+ * Every frame roots its JS object through the root stack while it is open.
+ * A container's depth counts the containers around it and itself, whether
+ * or not it needed a frame, so [[1]] and {a: {b: 1}} are both 2 deep. */
+struct frame {
+    PyObject *python;
+    JSObject *javascript;
+    JSIdArray *ids;
+    Py_ssize_t position;
+    Py_ssize_t length;
+    Py_ssize_t depth;
+    size_t root;
+};
+
+struct work_stack {
+    struct frame *frames;
+    size_t count;
+    size_t capacity;
+    Py_ssize_t nodes;
+    Py_ssize_t max_depth;
+    Py_ssize_t max_nodes;
+};
+
+static void init_work_stack(JSContext *context, struct work_stack *stack) {
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    memset(stack, 0, sizeof(struct work_stack));
+    stack->max_depth = evaluation->max_depth;
+    stack->max_nodes = evaluation->max_nodes;
 }
 
-static PyObject *spindly_js(PyObject *self, PyObject *args) {
-    JSRuntime *runtime;
-    JSContext *context;
-    JSObject *global;
+/* The depth of a container met now: children are converted while their
+ * parent's frame is the innermost one. */
+static Py_ssize_t container_depth(struct work_stack *stack) {
+    return stack->count > 0 ? stack->frames[stack->count - 1].depth + 1 : 1;
+}
 
-    char *script;
-    Py_ssize_t script_length;
-    PyObject *params = NULL;
-    int timeout = 10;
+static JSBool check_depth(struct work_stack *stack) {
+    if (stack->max_depth > 0 && container_depth(stack) > stack->max_depth) {
+        PyErr_Format(PyExc_ValueError, "conversion nested deeper than max_depth (%zd)",
+            stack->max_depth);
+        return JS_FALSE;
+    }
+    return JS_TRUE;
+}
 
-    jsval rvalue;
+/* Takes over the reference to python and ownership of ids. */
+static JSBool push_frame(JSContext *context, struct work_stack *stack, PyObject *python,
+        JSObject *javascript, JSIdArray *ids, Py_ssize_t length) {
+    struct frame *frame;
 
-    int error = 0;
-    struct watchdog *wd = NULL;
+    if (stack->count == stack->capacity) {
+        size_t capacity = stack->capacity ? stack->capacity * 2 : 32;
+        struct frame *frames = PyMem_Realloc(stack->frames, capacity * sizeof(struct frame));
+        if (!frames) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        stack->frames = frames;
+        stack->capacity = capacity;
+    }
 
-    if (!PyArg_ParseTuple(args, "s#|Oi:js", &script, &script_length, &params, &timeout)) {
-        return NULL;
+    frame = &stack->frames[stack->count];
+    if (!reserve_roots(context, 1, &frame->root)) {
+        goto error;
     }
-    if (params != NULL && !PyDict_Check(params)) {
-        return PyErr_Format(PyExc_TypeError, "params must be a dict");
+    get_runtime_data(context)->roots[frame->root] = OBJECT_TO_JSVAL(javascript);
+    frame->python = python;
+    frame->javascript = javascript;
+    frame->ids = ids;
+    frame->position = 0;
+    frame->length = length;
+    frame->depth = container_depth(stack);
+    stack->count++;
+    return JS_TRUE;
+
+error:
+    Py_DECREF(python);
+    if (ids) {
+        JS_DestroyIdArray(context, ids);
     }
+    return JS_FALSE;
+}
 
-    runtime = JS_NewRuntime(1024L * 1024L);
-    if (!runtime) {
-        return PyErr_Format(PyExc_SystemError, "unable to initialize JS runtime\n");
+static void pop_frame(JSContext *context, struct work_stack *stack) {
+    struct frame *frame = &stack->frames[--stack->count];
+    Py_DECREF(frame->python);
+    if (frame->ids) {
+        JS_DestroyIdArray(context, frame->ids);
     }
+    release_roots(context, frame->root);
+}
 
-    context = JS_NewContext(runtime, 8192);
-    if (!context) {
-        JS_DestroyRuntime(runtime);
-        return PyErr_Format(PyExc_SystemError, "unable to initialize JS context\n");
+static void clear_work_stack(JSContext *context, struct work_stack *stack) {
+    while (stack->count > 0) {
+        pop_frame(context, stack);
     }
+    PyMem_Free(stack->frames);
+}
 
-    JS_SetContextPrivate(context, &error);
-    JS_SetOptions(context, JSOPTION_VAROBJFIX);
-    JS_SetVersion(context, JSVERSION_LATEST);
-    JS_SetErrorReporter(context, raise_python_exception);
-    JS_SetOperationCallback(context, js_destroy);
+static JSBool count_nodes(struct work_stack *stack, Py_ssize_t count) {
+    stack->nodes += count;
+    if (stack->max_nodes > 0 && stack->nodes > stack->max_nodes) {
+        PyErr_Format(PyExc_ValueError, "conversion exceeds max_nodes (%zd)", stack->max_nodes);
+        return JS_FALSE;
+    }
+    return JS_TRUE;
+}
 
-    global = JS_NewCompartmentAndGlobalObject(context, &global_class, NULL);
-    JS_InitStandardClasses(context, global);
+static JSBool new_javascript_array(JSContext *context, struct work_stack *stack,
+        PyObject *value, jsval *rval);
 
-    if (params != NULL) {
-        populate_javascript_object(context, global, params);
+/* Converts a single value.  Containers are created here and pushed on the
+ * work stack; their children are converted by run_javascript_stack(). */
+static JSBool to_javascript_node(JSContext *context, struct work_stack *stack,
+        PyObject *value, jsval *rval) {
+    JSObject *obj;
+    if (!count_nodes(stack, 1)) {
+        return JS_FALSE;
     }
 
-    if (timeout > 0) {
-        wd = run_watchdog(context, timeout);
-        if (wd == NULL) {
-            shutdown(runtime, context);
-            return PyErr_Format(PyExc_SystemError, "unable to initialize JS watchdog\n");
+    if (PyString_Check(value)) {
+        JSString *str = JS_NewStringCopyN(context, PyString_AsString(value), PyString_Size(value));
+        if (!str) {
+            return JS_FALSE;
+        }
+        *rval = STRING_TO_JSVAL(str);
+    } else if (PyUnicode_Check(value)) {
+        PyObject *encoded = PyUnicode_AsUTF8String(value);
+        if (!encoded) {
+            return JS_FALSE;
         }
+        JSString *str = JS_NewStringCopyN(context, PyString_AsString(encoded), PyString_Size(encoded));
+        Py_DECREF(encoded);
+        if (!str) {
+            return JS_FALSE;
+        }
+        *rval = STRING_TO_JSVAL(str);
+    } else if (PyFloat_Check(value)) {
+        *rval = DOUBLE_TO_JSVAL(PyFloat_AsDouble(value));
+    } else if (PyInt_Check(value)) {
+        *rval = long_to_jsval(PyInt_AsLong(value));
+    } else if (PyLong_Check(value)) {
+        long number = PyLong_AsLong(value);
+        if (number == -1 && PyErr_Occurred()) {
+            PyErr_Clear();
+            jsdouble approximation = PyLong_AsDouble(value);
+            if (approximation == -1.0 && PyErr_Occurred()) {
+                return JS_FALSE;
+            }
+            *rval = DOUBLE_TO_JSVAL(approximation);
+        } else {
+            *rval = long_to_jsval(number);
+        }
+    } else if ((obj = find_javascript_object(context, value)) != NULL) {
+        *rval = OBJECT_TO_JSVAL(obj);
+    } else if (PyList_Check(value) || PyTuple_Check(value)) {
+        return check_depth(stack) && new_javascript_array(context, stack, value, rval);
+    } else if (PyDict_Check(value)) {
+        if (!check_depth(stack)) {
+            return JS_FALSE;
+        }
+        obj = JS_NewObject(context, NULL, NULL, NULL);
+        if (!obj || !remember_javascript_object(context, value, obj)) {
+            return JS_FALSE;
+        }
+        *rval = OBJECT_TO_JSVAL(obj);
+        if (PyDict_Size(value) > 0) {
+            Py_INCREF(value);
+            return push_frame(context, stack, value, obj, NULL, 0);
+        }
+    } else if (PyDateTime_Check(value)) {
+        obj = JS_NewDateObject(context,
+            PyDateTime_GET_YEAR(value),
+            PyDateTime_GET_MONTH(value) - 1,
+            PyDateTime_GET_DAY(value),
+            PyDateTime_DATE_GET_HOUR(value),
+            PyDateTime_DATE_GET_MINUTE(value),
+            PyDateTime_DATE_GET_SECOND(value));
+        if (!obj || !remember_javascript_object(context, value, obj)) {
+            return JS_FALSE;
+        }
+        *rval = OBJECT_TO_JSVAL(obj);
+    } else if (PyObject_CheckBuffer(value) || PyObject_CheckReadBuffer(value)) {
+        return buffer_to_typed_array(context, value, rval) &&
+            remember_javascript_object(context, value, JSVAL_TO_OBJECT(*rval));
+    } else if (PyObject_HasAttrString(value, "__array_interface__")) {
+        return interface_to_typed_array(context, value, rval) &&
+            remember_javascript_object(context, value, JSVAL_TO_OBJECT(*rval));
+    } else {
+        *rval = JSVAL_NULL;
     }
+    return JS_TRUE;
+}
 
-    JSBool retval = JS_EvaluateScript(context, global, script, script_length, "spindly", 1, &rvalue);
-    if (wd) {
-        shutdown_watchdog(wd);
+static JSBool new_javascript_array(JSContext *context, struct work_stack *stack,
+        PyObject *value, jsval *rval) {
+    PyObject *seq = PySequence_Fast(value, "expected a sequence");
+    if (!seq) {
+        return JS_FALSE;
     }
 
-    if (retval == JS_FALSE || error == 1) {
-        shutdown(runtime, context);
-        return NULL;
+    Py_ssize_t length = PySequence_Fast_GET_SIZE(seq);
+    PyObject **items = PySequence_Fast_ITEMS(seq);
+    JSObject *obj = NULL;
+    Py_ssize_t i;
+
+    if (length != (jsint) length) {
+        Py_DECREF(seq);
+        PyErr_Format(PyExc_ValueError, "sequence too long for a JS array");
+        return JS_FALSE;
     }
 
-    PyObject *obj = to_python_object(context, rvalue);
-    shutdown(runtime, context);
-    return obj;
-}
+    if (length > 0 && (PyFloat_CheckExact(items[0]) || PyInt_CheckExact(items[0]))) {
+        jsval *vector = PyMem_New(jsval, length);
+        if (!vector) {
+            Py_DECREF(seq);
+            PyErr_NoMemory();
+            return JS_FALSE;
+        }
+        if (to_numeric_vector(items, length, vector)) {
+            obj = count_nodes(stack, length) ? JS_NewArrayObject(context, (jsint) length, vector) : NULL;
+            PyMem_Free(vector);
+            Py_DECREF(seq);
+            if (!obj || !remember_javascript_object(context, value, obj)) {
+                return JS_FALSE;
+            }
+            *rval = OBJECT_TO_JSVAL(obj);
+            return JS_TRUE;
+        }
+        PyMem_Free(vector);
+    }
+
+    /* Leaves go straight into the vector; nested containers are converted
+     * from the work stack once the array exists, so they can refer back. */
+    size_t base;
+    int nested = 0;
+    if (!reserve_roots(context, length, &base)) {
+        Py_DECREF(seq);
+        return JS_FALSE;
+    }
+    for (i = 0; i < length; i++) {
+        jsval item;
+        if (is_container(items[i])) {
+            nested = 1;
+            continue;
+        }
+        if (!to_javascript_node(context, stack, items[i], &item)) {
+            release_roots(context, base);
+            Py_DECREF(seq);
+            return JS_FALSE;
+        }
+        get_runtime_data(context)->roots[base + i] = item;
+    }
+    obj = JS_NewArrayObject(context, (jsint) length, get_runtime_data(context)->roots + base);
+    release_roots(context, base);
+    if (!obj || !remember_javascript_object(context, value, obj)) {
+        Py_DECREF(seq);
+        return JS_FALSE;
+    }
+    *rval = OBJECT_TO_JSVAL(obj);
+
+    if (!nested) {
+        Py_DECREF(seq);
+        return JS_TRUE;
+    }
+    return push_frame(context, stack, seq, obj, NULL, length);
+}
+
+static JSBool run_javascript_stack(JSContext *context, struct work_stack *stack) {
+    while (stack->count > 0) {
+        struct frame *frame = &stack->frames[stack->count - 1];
+        JSObject *target = frame->javascript;
+        jsval item;
+
+        if (PyDict_Check(frame->python)) {
+            PyObject *key, *value;
+            jsid id;
+            if (!PyDict_Next(frame->python, &frame->position, &key, &value)) {
+                pop_frame(context, stack);
+                continue;
+            }
+            if (!PyString_Check(key) && !PyUnicode_Check(key) && !PyInt_Check(key) && !PyLong_Check(key)) {
+                continue;
+            }
+            if (!key_to_id(context, key, &id) ||
+                    !to_javascript_node(context, stack, value, &item) ||
+                    !JS_DefinePropertyById(context, target, id, item, NULL, NULL, JSPROP_ENUMERATE)) {
+                return JS_FALSE;
+            }
+        } else {
+            PyObject **items = PySequence_Fast_ITEMS(frame->python);
+            Py_ssize_t i = frame->position;
+            while (i < frame->length && !is_container(items[i])) {
+                i++;
+            }
+            if (i == frame->length) {
+                pop_frame(context, stack);
+                continue;
+            }
+            frame->position = i + 1;
+            if (!to_javascript_node(context, stack, items[i], &item) ||
+                    !JS_SetElement(context, target, (jsint) i, &item)) {
+                return JS_FALSE;
+            }
+        }
+    }
+    return JS_TRUE;
+}
+
+/* Entry points for Python -> JS conversion; each owns the identity memo
+ * unless it runs inside another conversion. */
+static JSBool begin_javascript_conversion(JSContext *context, int *outer) {
+    struct runtime_data *data = get_runtime_data(context);
+    *outer = data->to_javascript_memo == NULL;
+    if (*outer) {
+        data->to_javascript_memo = PyDict_New();
+        if (!data->to_javascript_memo) {
+            return JS_FALSE;
+        }
+    }
+    return JS_TRUE;
+}
+
+static void end_javascript_conversion(JSContext *context, int outer) {
+    if (outer) {
+        Py_CLEAR(get_runtime_data(context)->to_javascript_memo);
+    }
+}
+
+static JSBool to_javascript_object(JSContext *context, PyObject *value, jsval *rval) {
+    struct work_stack stack;
+    int outer;
+    if (!begin_javascript_conversion(context, &outer)) {
+        return JS_FALSE;
+    }
+    init_work_stack(context, &stack);
+    JSBool ok = to_javascript_node(context, &stack, value, rval) &&
+        run_javascript_stack(context, &stack);
+    clear_work_stack(context, &stack);
+    end_javascript_conversion(context, outer);
+    return ok;
+}
+
+/* Defines the params as properties of the global.  In the memo the params
+ * dict itself stands for the global. */
+static JSBool populate_javascript_params(JSContext *context, JSObject *global, PyObject *params) {
+    struct work_stack stack;
+    int outer;
+    if (!begin_javascript_conversion(context, &outer)) {
+        return JS_FALSE;
+    }
+    init_work_stack(context, &stack);
+    JSBool ok = remember_javascript_object(context, params, global);
+    if (ok) {
+        Py_INCREF(params);
+        ok = push_frame(context, &stack, params, global, NULL, 0);
+        if (ok) {
+            /* the params are variables, not a level of nesting */
+            stack.frames[0].depth = 0;
+            ok = run_javascript_stack(context, &stack);
+        }
+    }
+    clear_work_stack(context, &stack);
+    end_javascript_conversion(context, outer);
+    return ok;
+}
+
+static PyObject *to_python_datetime(JSContext *context, JSObject *obj) {
+    jsval year, month, day, hour, minute, second;
+    if (!JS_CallFunctionName(context, obj, "getFullYear", 0, NULL, &year)) {
+        return NULL;
+    }
+    if (!JS_CallFunctionName(context, obj, "getMonth", 0, NULL, &month)) {
+        return NULL;
+    }
+    if (!JS_CallFunctionName(context, obj, "getDate", 0, NULL, &day)) {
+        return NULL;
+    }
+    if (!JS_CallFunctionName(context, obj, "getHours", 0, NULL, &hour)) {
+        return NULL;
+    }
+    if (!JS_CallFunctionName(context, obj, "getMinutes", 0, NULL, &minute)) {
+        return NULL;
+    }
+    if (!JS_CallFunctionName(context, obj, "getSeconds", 0, NULL, &second)) {
+        return NULL;
+    }
+    return PyDateTime_FromDateAndTime(JSVAL_TO_INT(year), JSVAL_TO_INT(month) + 1,
+        JSVAL_TO_INT(day), JSVAL_TO_INT(hour), JSVAL_TO_INT(minute),
+        JSVAL_TO_INT(second), 0);
+}
+
+/* The JS -> Python memo and key cache are keyed on addresses, so whatever
+ * they hold is kept alive until the conversion ends: a collected object or
+ * atom could otherwise hand its address, and its entry, to a new one. */
+static int keep_visited(JSContext *context, jsval value) {
+    struct runtime_data *data = get_runtime_data(context);
+    return JS_SetElement(context, data->visited, data->visited_count++, &value);
+}
+
+static int remember_python_object(JSContext *context, JSObject *obj, PyObject *value) {
+    struct runtime_data *data = get_runtime_data(context);
+    if (!keep_visited(context, OBJECT_TO_JSVAL(obj))) {
+        return 0;
+    }
+    PyObject *key = PyLong_FromVoidPtr(obj);
+    if (!key) {
+        return 0;
+    }
+    int status = PyDict_SetItem(data->to_python_memo, key, value);
+    Py_DECREF(key);
+    return status == 0;
+}
+
+static PyObject *find_python_object(JSContext *context, JSObject *obj) {
+    struct runtime_data *data = get_runtime_data(context);
+    PyObject *key = PyLong_FromVoidPtr(obj);
+    if (!key) {
+        PyErr_Clear();
+        return NULL;
+    }
+    PyObject *value = PyDict_GetItem(data->to_python_memo, key);
+    Py_DECREF(key);
+    Py_XINCREF(value);
+    return value;
+}
+
+static PyObject *to_python_string(JSContext *context, JSString *str) {
+    char *bytes = JS_EncodeString(context, str);
+    if (!bytes) {
+        return NULL;
+    }
+    PyObject *result = PyUnicode_FromString(bytes);
+    JS_free(context, bytes);
+    return result;
+}
+
+/* Converts a property id to a dict key.  String keys are converted once per
+ * result and the same key object is shared by every object that uses it. */
+static PyObject *id_to_key(JSContext *context, jsid id) {
+    if (JSID_IS_INT(id)) {
+        return PyLong_FromLong(JSID_TO_INT(id));
+    } else if (!JSID_IS_STRING(id)) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    struct runtime_data *data = get_runtime_data(context);
+    PyObject *cache_key = PyLong_FromVoidPtr((void *) id);
+    if (!cache_key) {
+        return NULL;
+    }
+    PyObject *key = PyDict_GetItem(data->keys, cache_key);
+    if (key) {
+        Py_DECREF(cache_key);
+        Py_INCREF(key);
+        return key;
+    }
+
+    key = to_python_string(context, JSID_TO_STRING(id));
+    if (key && (!keep_visited(context, STRING_TO_JSVAL(JSID_TO_STRING(id)))
+            || PyDict_SetItem(data->keys, cache_key, key) < 0)) {
+        Py_CLEAR(key);
+    }
+    Py_DECREF(cache_key);
+    return key;
+}
+
+static const char typed_array_typecodes[] = "bBhHiIfdB";
+static const char *typed_array_dtypes[] = {"i1", "u1", "i2", "u2", "i4", "u4", "f4", "f8", "u1"};
+
+static PyObject *numpy_frombuffer = NULL;
+
+/* With numpy=True typed arrays come back as ndarrays viewing a private copy
+ * of the data; numpy is only imported once it is first asked for. */
+static PyObject *to_numpy_array(int type, void *data, size_t size) {
+    if (!numpy_frombuffer) {
+        PyObject *numpy = PyImport_ImportModule("numpy");
+        if (!numpy) {
+            return NULL;
+        }
+        numpy_frombuffer = PyObject_GetAttrString(numpy, "frombuffer");
+        Py_DECREF(numpy);
+        if (!numpy_frombuffer) {
+            return NULL;
+        }
+    }
+
+    PyObject *storage = PyByteArray_FromStringAndSize(data, size);
+    if (!storage) {
+        return NULL;
+    }
+    PyObject *result = PyObject_CallFunction(numpy_frombuffer, "Os", storage, typed_array_dtypes[type]);
+    Py_DECREF(storage);
+    return result;
+}
+
+/* Typed arrays come back as array.array and ArrayBuffers as bytearray.  The
+ * engine's storage goes away with the runtime, so it is copied once through
+ * a buffer object that wraps it in place. */
+static PyObject *to_python_buffer(JSContext *context, JSObject *obj) {
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    void *data;
+    jsuint length;
+    int type;
+
+    if (get_array_buffer(obj, &data, &length)) {
+        return PyByteArray_FromStringAndSize(data, length);
+    } else if (!get_typed_array(obj, &type, &data, &length)) {
+        return NULL;
+    }
+
+    size_t size = length * typed_array_item_size(type);
+    if (evaluation->numpy) {
+        return to_numpy_array(type, data, size);
+    }
+
+    PyObject *storage = PyBuffer_FromMemory(data, size);
+    if (!storage) {
+        return NULL;
+    }
+    PyObject *result = PyObject_CallFunction(array_type, "c", typed_array_typecodes[type]);
+    if (result) {
+        PyObject *status = PyObject_CallMethod(result, "fromstring", "O", storage);
+        if (!status) {
+            Py_CLEAR(result);
+        }
+        Py_XDECREF(status);
+    }
+    Py_DECREF(storage);
+    return result;
+}
+
+/* Converts a single value.  Arrays and objects are created empty, pushed on
+ * the work stack and filled in by run_python_stack(). */
+static PyObject *to_python_node(JSContext *context, struct work_stack *stack, jsval value) {
+    if (!count_nodes(stack, 1)) {
+        return NULL;
+    }
+
+    if (JSVAL_IS_PRIMITIVE(value)) {
+        if (JSVAL_IS_STRING(value)) {
+            return to_python_string(context, JSVAL_TO_STRING(value));
+        } else if (JSVAL_IS_BOOLEAN(value)) {
+            return PyBool_FromLong(JSVAL_TO_BOOLEAN(value));
+        } else if (JSVAL_IS_INT(value)) {
+            return PyLong_FromLong(JSVAL_TO_INT(value));
+        } else if (JSVAL_IS_DOUBLE(value)) {
+            return PyFloat_FromDouble(JSVAL_TO_DOUBLE(value));
+        } else {
+            Py_INCREF(Py_None);
+            return Py_None;
+        }
+    }
+
+    JSObject *obj = JSVAL_TO_OBJECT(value);
+    PyObject *result = find_python_object(context, obj);
+    if (result) {
+        return result;
+    }
+
+    if (JS_IsArrayObject(context, obj)) {
+        jsuint length;
+        if (!check_depth(stack) || !JS_GetArrayLength(context, obj, &length)) {
+            return NULL;
+        }
+        result = PyList_New(length);
+        if (!result || !remember_python_object(context, obj, result)) {
+            Py_XDECREF(result);
+            return NULL;
+        }
+        if (length > 0) {
+            Py_INCREF(result);
+            if (!push_frame(context, stack, result, obj, NULL, length)) {
+                Py_DECREF(result);
+                return NULL;
+            }
+        }
+        return result;
+    } else if (JS_ObjectIsDate(context, obj)) {
+        result = to_python_datetime(context, obj);
+    } else if (is_typed_array(obj) || is_array_buffer(obj)) {
+        result = to_python_buffer(context, obj);
+    } else {
+        if (!check_depth(stack)) {
+            return NULL;
+        }
+        JSIdArray *ids = JS_Enumerate(context, obj);
+        if (!ids) {
+            return NULL;
+        }
+        result = PyDict_New();
+        if (!result || !remember_python_object(context, obj, result)) {
+            JS_DestroyIdArray(context, ids);
+            Py_XDECREF(result);
+            return NULL;
+        }
+        if (ids->length == 0) {
+            JS_DestroyIdArray(context, ids);
+            return result;
+        }
+        Py_INCREF(result);
+        if (!push_frame(context, stack, result, obj, ids, ids->length)) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        return result;
+    }
+
+    if (result && !remember_python_object(context, obj, result)) {
+        Py_CLEAR(result);
+    }
+    return result;
+}
+
+static JSBool run_python_stack(JSContext *context, struct work_stack *stack) {
+    while (stack->count > 0) {
+        struct frame *frame = &stack->frames[stack->count - 1];
+        if (frame->position == frame->length) {
+            pop_frame(context, stack);
+            continue;
+        }
+
+        PyObject *target = frame->python;
+        JSObject *source = frame->javascript;
+        Py_ssize_t i = frame->position++;
+        jsval item;
+
+        if (!frame->ids) {
+            if (!JS_GetElement(context, source, (jsint) i, &item)) {
+                return JS_FALSE;
+            }
+            PyObject *value = to_python_node(context, stack, item);
+            if (!value) {
+                return JS_FALSE;
+            }
+            PyList_SET_ITEM(target, i, value);
+            continue;
+        }
+
+        jsid id = frame->ids->vector[i];
+        PyObject *key = id_to_key(context, id);
+        if (!key) {
+            return JS_FALSE;
+        } else if (key == Py_None) {
+            Py_DECREF(key);
+            continue;
+        }
+        if (!JS_GetPropertyById(context, source, id, &item)) {
+            Py_DECREF(key);
+            return JS_FALSE;
+        }
+        PyObject *value = to_python_node(context, stack, item);
+        if (!value) {
+            Py_DECREF(key);
+            return JS_FALSE;
+        }
+        int status = PyDict_SetItem(target, key, value);
+        Py_DECREF(key);
+        Py_DECREF(value);
+        if (status < 0) {
+            return JS_FALSE;
+        }
+    }
+    return JS_TRUE;
+}
+
+/* Entry point for JS -> Python conversion; owns the per-result key cache and
+ * memo.  Nested conversions share the outermost ones. */
+static PyObject *to_python_object(JSContext *context, jsval value) {
+    struct runtime_data *data = get_runtime_data(context);
+    struct work_stack stack;
+    size_t anchor = 0;
+    int outer = data->keys == NULL;
+    if (outer) {
+        data->keys = PyDict_New();
+        data->to_python_memo = PyDict_New();
+        data->visited = JS_NewArrayObject(context, 0, NULL);
+        if (!data->keys || !data->to_python_memo || !data->visited || !reserve_roots(context, 1, &anchor)) {
+            Py_CLEAR(data->keys);
+            Py_CLEAR(data->to_python_memo);
+            data->visited = NULL;
+            return NULL;
+        }
+        data->roots[anchor] = OBJECT_TO_JSVAL(data->visited);
+        data->visited_count = 0;
+    }
+
+    init_work_stack(context, &stack);
+    PyObject *result = to_python_node(context, &stack, value);
+    if (result && !run_python_stack(context, &stack)) {
+        Py_CLEAR(result);
+    }
+    clear_work_stack(context, &stack);
+
+    if (outer) {
+        Py_CLEAR(data->keys);
+        Py_CLEAR(data->to_python_memo);
+        release_roots(context, anchor);
+        data->visited = NULL;
+    }
+    return result;
+}
+
+static double monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+struct watchdog {
+    pthread_t tid;
+    JSContext *context;
+    struct evaluation *evaluation;
+    int pipe[2];
+};
+
+/* A timeout is reported as a "timeout" exception; a cancelled call is
+ * terminated without one, so that no catch block can keep it running. */
+JSBool js_destroy(JSContext *context) {
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    if (evaluation && evaluation->cancelled) {
+        return JS_FALSE;
+    }
+    JS_SetPendingException(context, STRING_TO_JSVAL(JS_NewStringCopyZ(context, "timeout")));
+    return JS_FALSE;
+}
+
+void *js_watchdog(void *ptr) {
+    struct watchdog *wd = (struct watchdog *) ptr;
+    struct pollfd poller;
+
+    poller.fd = wd->pipe[1];
+    poller.events = POLLIN;
+
+    /* expires may move on while the script waits in emit(), and poll()
+     * takes an int, so the remaining time is looked up again on waking */
+    int retval = 0;
+    for (;;) {
+        double remaining = (wd->evaluation->expires - monotonic_seconds()) * 1000;
+        if (remaining <= 0) {
+            break;
+        }
+        retval = poll(&poller, 1, remaining >= INT_MAX ? INT_MAX : (int) remaining + 1);
+        if (retval != 0) {
+            break;
+        }
+    }
+    if (retval <= 0) {
+        JS_TriggerOperationCallback(wd->context);
+    }
+    return NULL;
+}
+
+struct watchdog *run_watchdog(JSContext *context, struct evaluation *evaluation) {
+    struct watchdog *wd;
+
+    wd = calloc(sizeof(struct watchdog), 1);
+    if (!wd) {
+        return NULL;
+    }
+
+    wd->context = context;
+    if (pipe(wd->pipe) < 0) {
+        free(wd);
+        return NULL;
+    }
+
+    wd->evaluation = evaluation;
+    if (pthread_create(&wd->tid, NULL, js_watchdog, wd) != 0) {
+        close(wd->pipe[0]);
+        close(wd->pipe[1]);
+        free(wd);
+        return NULL;
+    }
+    return wd;
+}
+
+void shutdown_watchdog(struct watchdog *wd) {
+    close(wd->pipe[0]);
+    close(wd->pipe[1]);
+    (void) pthread_join(wd->tid, NULL);
+    free(wd);
+}
+
+/* Every runtime gets a GC heap this large; 1.8.5 treats it as a hard limit. */
+#define RUNTIME_MAX_BYTES (64L * 1024L * 1024L)
+
+void shutdown(JSContext *context) {
+    JSRuntime *runtime = JS_GetRuntime(context);
+#ifdef JS_THREADSAFE
+    JS_SetContextThread(context);
+#endif
+    JS_DestroyContext(context);
+    free_runtime_data(runtime);
+    JS_DestroyRuntime(runtime);
+}
+
+/* Creates a runtime with a single context, configured the way every script
+ * runs.  The context is left unbound, so that any thread can enter it. */
+static JSContext *new_context(void) {
+    JSRuntime *runtime = JS_NewRuntime(RUNTIME_MAX_BYTES);
+    if (!runtime) {
+        PyErr_Format(PyExc_SystemError, "unable to initialize JS runtime\n");
+        return NULL;
+    }
+
+    if (!new_runtime_data(runtime)) {
+        JS_DestroyRuntime(runtime);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    JSContext *context = JS_NewContext(runtime, 8192);
+    if (!context) {
+        free_runtime_data(runtime);
+        JS_DestroyRuntime(runtime);
+        PyErr_Format(PyExc_SystemError, "unable to initialize JS context\n");
+        return NULL;
+    }
+
+    JS_SetOptions(context, JSOPTION_VAROBJFIX);
+    JS_SetVersion(context, JSVERSION_LATEST);
+    JS_SetErrorReporter(context, raise_python_exception);
+    JS_SetOperationCallback(context, js_destroy);
+#ifdef JS_THREADSAFE
+    JS_ClearContextThread(context);
+#endif
+    return context;
+}
+
+/* A context is used by one thread at a time; entering binds it to the
+ * current thread, opens a request and installs the call's evaluation. */
+static void enter_context(JSContext *context, struct evaluation *evaluation) {
+#ifdef JS_THREADSAFE
+    JS_SetContextThread(context);
+    JS_BeginRequest(context);
+#endif
+    JS_SetContextPrivate(context, evaluation);
+    JS_SetOptions(context, JSOPTION_VAROBJFIX | evaluation->jit);
+}
+
+static void leave_context(JSContext *context) {
+    JS_SetContextPrivate(context, NULL);
+#ifdef JS_THREADSAFE
+    JS_EndRequest(context);
+    JS_ClearContextThread(context);
+#endif
+}
+
+static JSObject *new_global(JSContext *context) {
+    JSObject *global = JS_NewCompartmentAndGlobalObject(context, &global_class, NULL);
+    if (!global) {
+        return NULL;
+    }
+    JS_SetGlobalObject(context, global);
+    return global;
+}
+
+/* JIT modes, as accepted by the jit option.  True lets the profiler choose
+ * between the tracing and method JITs per loop; False interprets. */
+#define JIT_MODES 4
+#define JIT_AUTO (JSOPTION_JIT | JSOPTION_METHODJIT | JSOPTION_PROFILING)
+
+static const char *jit_names[JIT_MODES] = {"interpreter", "trace", "method", "auto"};
+static const uint32 jit_options[JIT_MODES] = {0, JSOPTION_JIT, JSOPTION_METHODJIT, JIT_AUTO};
+
+static int jit_mode(uint32 options) {
+    int mode;
+    for (mode = 0; mode < JIT_MODES; mode++) {
+        if (jit_options[mode] == options) {
+            return mode;
+        }
+    }
+    return 0;
+}
+
+static int parse_jit(PyObject *value, uint32 *options) {
+    int mode;
+    if (value == NULL) {
+        return 1;
+    }
+    if (PyBool_Check(value)) {
+        *options = value == Py_True ? JIT_AUTO : 0;
+        return 1;
+    }
+    if (PyString_Check(value)) {
+        for (mode = 0; mode < JIT_MODES; mode++) {
+            if (strcmp(PyString_AS_STRING(value), jit_names[mode]) == 0) {
+                *options = jit_options[mode];
+                return 1;
+            }
+        }
+    }
+    PyErr_Format(PyExc_ValueError, "jit must be a bool or one of 'interpreter', 'trace', 'method', 'auto'");
+    return 0;
+}
+
+/* Run counts and evaluation time per JIT mode, reported by metrics(). */
+static struct {
+    unsigned long long runs;
+    double seconds;
+} jit_metrics[JIT_MODES];
+
+static struct evaluation *default_evaluation(struct evaluation *evaluation, uint32 jit) {
+    memset(evaluation, 0, sizeof(struct evaluation));
+    evaluation->timeout = 10;
+    evaluation->jit = jit;
+    evaluation->max_depth = DEFAULT_MAX_DEPTH;
+    return evaluation;
+}
+
+/* deadline is an absolute time on the monotonic() clock.  Work sharing one
+ * deadline stops at it however many scripts it spans, while timeout still
+ * bounds each script on its own. */
+static int parse_evaluation(PyObject *args, PyObject *kwargs, struct evaluation *evaluation, uint32 jit) {
+    static char *kwlist[] = {"script", "params", "timeout", "numpy", "max_depth", "max_nodes", "jit",
+        "functions", "emit", "deadline", NULL};
+    PyObject *jit_value = NULL;
+
+    default_evaluation(evaluation, jit);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|OiinnOOOd:js", kwlist, &evaluation->script,
+            &evaluation->script_length, &evaluation->params, &evaluation->timeout,
+            &evaluation->numpy, &evaluation->max_depth, &evaluation->max_nodes, &jit_value,
+            &evaluation->functions, &evaluation->emit, &evaluation->deadline)) {
+        return 0;
+    }
+    if (evaluation->emit == Py_None) {
+        evaluation->emit = NULL;
+    }
+    if (evaluation->emit != NULL && !PyCallable_Check(evaluation->emit)) {
+        PyErr_Format(PyExc_TypeError, "emit must be callable");
+        return 0;
+    }
+    if (evaluation->functions == Py_None) {
+        evaluation->functions = NULL;
+    }
+    if (evaluation->functions != NULL && !PyDict_Check(evaluation->functions)) {
+        PyErr_Format(PyExc_TypeError, "functions must be a dict");
+        return 0;
+    }
+    if (!parse_jit(jit_value, &evaluation->jit)) {
+        return 0;
+    }
+    if (evaluation->params == Py_None) {
+        evaluation->params = NULL;
+    }
+    if (evaluation->params != NULL && !PyDict_Check(evaluation->params)) {
+        PyErr_Format(PyExc_TypeError, "params must be a dict");
+        return 0;
+    }
+    return 1;
+}
+
+/* Starts the watchdog for one run: it fires at the sooner of the timeout
+ * and the deadline, which is also what __remaining_ms() counts down to.
+ * Fails, without starting one, once the deadline has passed. */
+static int start_watchdog(JSContext *context, struct evaluation *evaluation, struct watchdog **wd) {
+    double now = monotonic_seconds();
+    evaluation->expires = evaluation->timeout > 0 ? now + evaluation->timeout : 0;
+    if (evaluation->deadline > 0 && (evaluation->expires == 0 || evaluation->deadline < evaluation->expires)) {
+        evaluation->expires = evaluation->deadline;
+    }
+
+    *wd = NULL;
+    if (evaluation->expires == 0) {
+        return 1;
+    }
+    if (evaluation->expires <= now) {
+        PyErr_Format(PyExc_ValueError, "deadline exceeded");
+        return 0;
+    }
+    *wd = run_watchdog(context, evaluation);
+    if (*wd == NULL) {
+        PyErr_Format(PyExc_SystemError, "unable to initialize JS watchdog\n");
+        return 0;
+    }
+    return 1;
+}
+
+static JSBool run_script(JSContext *context, JSObject *scope, const char *script, size_t length,
+        const char *filename, jsval *rvalue) {
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    struct watchdog *wd;
+
+    if (!start_watchdog(context, evaluation, &wd)) {
+        return JS_FALSE;
+    }
+
+    int mode = jit_mode(evaluation->jit);
+    double started = monotonic_seconds();
+    JSBool retval;
+    Py_BEGIN_ALLOW_THREADS
+    retval = JS_EvaluateScript(context, scope, script, length, filename, 1, rvalue);
+    Py_END_ALLOW_THREADS
+    jit_metrics[mode].runs++;
+    jit_metrics[mode].seconds += monotonic_seconds() - started;
+    if (wd) {
+        shutdown_watchdog(wd);
+    }
+
+    if (retval == JS_FALSE || evaluation->error == 1) {
+        JS_ClearPendingException(context);
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_ValueError, "%s: script terminated", filename);
+        }
+        return JS_FALSE;
+    }
+    return JS_TRUE;
+}
+
+/* Native behind every function passed in functions.  The script runs
+ * without the GIL; it is held only while arguments are converted, the
+ * callable runs and its result is converted back.  A Python exception ends
+ * the script and propagates from the call as is. */
+static JSBool call_host_function(JSContext *context, uintN argc, jsval *vp) {
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    JSObject *callee = JSVAL_TO_OBJECT(JS_CALLEE(context, vp));
+    jsval *argv = JS_ARGV(context, vp);
+    PyObject *callable = NULL;
+    Py_ssize_t i;
+
+    for (i = 0; i < evaluation->host_count; i++) {
+        if (evaluation->hosts[i].object == callee) {
+            callable = evaluation->hosts[i].callable;
+            break;
+        }
+    }
+    if (!callable) {
+        JS_ReportError(context, "host function is not available in this call");
+        return JS_FALSE;
+    }
+
+    PyGILState_STATE state = PyGILState_Ensure();
+    JSBool ok = JS_FALSE;
+    PyObject *arguments = PyTuple_New(argc);
+    if (arguments) {
+        for (i = 0; i < argc; i++) {
+            PyObject *argument = to_python_object(context, argv[i]);
+            if (!argument) {
+                break;
+            }
+            PyTuple_SET_ITEM(arguments, i, argument);
+        }
+        if (i == argc) {
+            PyObject *result = PyObject_CallObject(callable, arguments);
+            if (result) {
+                jsval rval;
+                ok = to_javascript_object(context, result, &rval);
+                if (ok) {
+                    JS_SET_RVAL(context, vp, rval);
+                }
+                Py_DECREF(result);
+            }
+        }
+        Py_DECREF(arguments);
+    }
+    if (!ok && !PyErr_Occurred()) {
+        PyErr_Format(PyExc_SystemError, "unable to convert host function call\n");
+    }
+    PyGILState_Release(state);
+    return ok;
+}
+
+static JSBool define_host_function(JSContext *context, JSObject *scope, const char *name,
+        PyObject *callable) {
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    JSFunction *function = JS_DefineFunction(context, scope, name, call_host_function, 0, 0);
+    if (!function) {
+        return JS_FALSE;
+    }
+
+    Py_INCREF(callable);
+    evaluation->hosts[evaluation->host_count].object = JS_GetFunctionObject(function);
+    evaluation->hosts[evaluation->host_count].callable = callable;
+    evaluation->host_count++;
+    return JS_TRUE;
+}
+
+/* Defines the entries of functions, then emit() when the call streams. */
+static JSBool define_host_functions(JSContext *context, JSObject *scope) {
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    Py_ssize_t count = evaluation->functions ? PyDict_Size(evaluation->functions) : 0;
+    PyObject *name, *callable;
+    Py_ssize_t position = 0;
+
+    evaluation->hosts = PyMem_Malloc(sizeof(struct host_function) * (count + 1));
+    if (!evaluation->hosts) {
+        PyErr_NoMemory();
+        return JS_FALSE;
+    }
+
+    while (count > 0 && PyDict_Next(evaluation->functions, &position, &name, &callable)) {
+        PyObject *encoded = PyUnicode_Check(name) ? PyUnicode_AsUTF8String(name) : name;
+        if (!encoded) {
+            return JS_FALSE;
+        }
+        if (!PyString_Check(encoded) || !PyCallable_Check(callable)) {
+            if (encoded != name) {
+                Py_DECREF(encoded);
+            }
+            PyErr_Format(PyExc_TypeError, "functions must map names to callables");
+            return JS_FALSE;
+        }
+
+        JSBool ok = define_host_function(context, scope, PyString_AS_STRING(encoded), callable);
+        if (encoded != name) {
+            Py_DECREF(encoded);
+        }
+        if (!ok) {
+            return JS_FALSE;
+        }
+    }
+
+    if (evaluation->emit != NULL) {
+        return define_host_function(context, scope, "emit", evaluation->emit);
+    }
+    return JS_TRUE;
+}
+
+static void free_host_functions(struct evaluation *evaluation) {
+    Py_ssize_t i;
+    for (i = 0; i < evaluation->host_count; i++) {
+        Py_DECREF(evaluation->hosts[i].callable);
+    }
+    PyMem_Free(evaluation->hosts);
+    evaluation->hosts = NULL;
+    evaluation->host_count = 0;
+}
+
+/* __remaining_ms(): milliseconds left before the running script is
+ * stopped, or Infinity when nothing will stop it. */
+static JSBool remaining_ms(JSContext *context, uintN argc, jsval *vp) {
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    if (evaluation->expires == 0) {
+        JS_SET_RVAL(context, vp, JS_GetPositiveInfinityValue(context));
+        return JS_TRUE;
+    }
+    jsdouble remaining = (evaluation->expires - monotonic_seconds()) * 1000;
+    return JS_NewNumberValue(context, remaining > 0 ? remaining : 0, vp);
+}
+
+/* Defines __remaining_ms(), then the evaluation's host functions and params
+ * on scope.  A session's scope keeps __remaining_ms() from its first run,
+ * since scripts can neither replace nor delete it. */
+static JSBool prepare_scope(JSContext *context, JSObject *scope) {
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    JSBool defined;
+
+    if (!JS_AlreadyHasOwnProperty(context, scope, "__remaining_ms", &defined) ||
+        (!defined && !JS_DefineFunction(context, scope, "__remaining_ms", remaining_ms, 0,
+                                        JSPROP_READONLY | JSPROP_PERMANENT))) {
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_SystemError, "unable to define __remaining_ms\n");
+        }
+        return JS_FALSE;
+    }
+
+    if ((evaluation->functions != NULL || evaluation->emit != NULL) && !define_host_functions(context, scope)) {
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_SystemError, "unable to define host functions\n");
+        }
+        return JS_FALSE;
+    }
+
+    if (evaluation->params != NULL && !populate_javascript_params(context, scope, evaluation->params)) {
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_SystemError, "unable to convert params\n");
+        }
+        return JS_FALSE;
+    }
+    return JS_TRUE;
+}
+
+/* Runs the call described by the context's evaluation against scope: params
+ * and host functions are defined on scope, the script runs under the
+ * watchdog and its result is converted back to Python. */
+static PyObject *evaluate(JSContext *context, JSObject *scope) {
+    struct evaluation *evaluation = JS_GetContextPrivate(context);
+    PyObject *obj = NULL;
+    jsval rvalue;
+
+    if (!prepare_scope(context, scope)) {
+        goto done;
+    }
+
+    if (!run_script(context, scope, evaluation->script, evaluation->script_length, "spindly", &rvalue)) {
+        goto done;
+    }
+
+    obj = to_python_object(context, rvalue);
+    if (!obj && !PyErr_Occurred()) {
+        PyErr_Format(PyExc_SystemError, "unable to convert result\n");
+    }
+
+done:
+    if (evaluation->hosts) {
+        free_host_functions(evaluation);
+    }
+    return obj;
+}
+
+static PyObject *spindly_js(PyObject *self, PyObject *args, PyObject *kwargs) {
+    struct evaluation evaluation;
+    if (!parse_evaluation(args, kwargs, &evaluation, 0)) {
+        return NULL;
+    }
+
+    JSContext *context = new_context();
+    if (!context) {
+        return NULL;
+    }
+
+    enter_context(context, &evaluation);
+    PyObject *result = NULL;
+    JSObject *global = new_global(context);
+    if (global) {
+        result = evaluate(context, global);
+    } else if (!PyErr_Occurred()) {
+        PyErr_Format(PyExc_SystemError, "unable to initialize JS global\n");
+    }
+    leave_context(context);
+    shutdown(context);
+    return result;
+}
+
+/* A Runtime keeps one engine runtime and context alive across calls.  Its
+ * prelude is run once into a template global.  Each call gets a fresh scope
+ * object whose prototype is that global and which has no parent.  The
+ * helpers are found through the prototype chain without being re-run, and
+ * variables a call defines land on its scope rather than on the template. */
+typedef struct {
+    PyObject_HEAD
+    JSContext *context;
+    JSObject *global;
+    PyObject *prelude;
+    uint32 jit;
+    PyThread_type_lock lock;
+    long owner;
+} RuntimeObject;
+
+static JSClass scope_class = {
+    .name = "scope",
+    .flags = 0,
+    .addProperty = JS_PropertyStub,
+    .delProperty = JS_PropertyStub,
+    .getProperty = JS_PropertyStub,
+    .setProperty = JS_StrictPropertyStub,
+    .enumerate = JS_EnumerateStub,
+    .resolve = JS_ResolveStub,
+    .convert = JS_ConvertStub,
+    .finalize = JS_FinalizeStub,
+    JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
+static JSObject *new_scope(JSContext *context, JSObject *global) {
+    JSObject *scope = JS_NewObject(context, &scope_class, global, NULL);
+    if (!scope || !JS_SetParent(context, scope, NULL)) {
+        return NULL;
+    }
+    return scope;
+}
+
+static PyObject *normalize_prelude(PyObject *prelude) {
+    if (prelude == NULL || prelude == Py_None) {
+        return PyTuple_New(0);
+    }
+
+    PyObject *sources = PySequence_Tuple(prelude);
+    Py_ssize_t i;
+    if (!sources) {
+        return NULL;
+    }
+    for (i = 0; i < PyTuple_GET_SIZE(sources); i++) {
+        PyObject *source = PyTuple_GET_ITEM(sources, i);
+        if (!PyString_Check(source) && !PyUnicode_Check(source)) {
+            Py_DECREF(sources);
+            return PyErr_Format(PyExc_TypeError, "prelude must be a sequence of sources");
+        }
+    }
+    return sources;
+}
+
+/* Builds a template global and runs the prelude sources into it. */
+static JSObject *load_prelude(JSContext *context, PyObject *sources, int fresh_compartment) {
+    JSObject *global;
+    Py_ssize_t i;
+
+    if (fresh_compartment) {
+        global = new_global(context);
+    } else {
+        global = JS_NewGlobalObject(context, &global_class);
+    }
+    if (!global) {
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_SystemError, "unable to initialize JS global\n");
+        }
+        return NULL;
+    }
+
+    for (i = 0; i < PyTuple_GET_SIZE(sources); i++) {
+        PyObject *source = PyTuple_GET_ITEM(sources, i);
+        PyObject *encoded = PyUnicode_Check(source) ? PyUnicode_AsUTF8String(source) : source;
+        char filename[32];
+        jsval rvalue;
+
+        if (!encoded) {
+            return NULL;
+        }
+        snprintf(filename, sizeof(filename), "prelude[%d]", (int) i);
+        JSBool ok = run_script(context, global, PyString_AS_STRING(encoded),
+            PyString_GET_SIZE(encoded), filename, &rvalue);
+        if (encoded != source) {
+            Py_DECREF(encoded);
+        }
+        if (!ok) {
+            return NULL;
+        }
+    }
+    return global;
+}
+
+static int Runtime_init(RuntimeObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"prelude", "jit", NULL};
+    PyObject *prelude = NULL, *jit = NULL;
+    struct evaluation evaluation;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO:Runtime", kwlist, &prelude, &jit)) {
+        return -1;
+    }
+    if (self->context) {
+        PyErr_Format(PyExc_RuntimeError, "Runtime is already initialized");
+        return -1;
+    }
+
+    if (!parse_jit(jit, &self->jit)) {
+        return -1;
+    }
+
+    self->lock = PyThread_allocate_lock();
+    if (!self->lock) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    PyObject *sources = normalize_prelude(prelude);
+    if (!sources) {
+        return -1;
+    }
+
+    self->context = new_context();
+    if (!self->context) {
+        Py_DECREF(sources);
+        return -1;
+    }
+
+    enter_context(self->context, default_evaluation(&evaluation, self->jit));
+    self->global = load_prelude(self->context, sources, 1);
+    if (self->global && !JS_AddNamedObjectRoot(self->context, &self->global, "spindly prelude")) {
+        self->global = NULL;
+    }
+    leave_context(self->context);
+
+    if (!self->global) {
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_SystemError, "unable to load prelude\n");
+        }
+        shutdown(self->context);
+        self->context = NULL;
+        PyThread_free_lock(self->lock);
+        self->lock = NULL;
+        Py_DECREF(sources);
+        return -1;
+    }
+    self->prelude = sources;
+    return 0;
+}
+
+static void Runtime_dealloc(RuntimeObject *self) {
+    if (self->context) {
+        struct evaluation evaluation;
+        enter_context(self->context, default_evaluation(&evaluation, self->jit));
+        JS_RemoveObjectRoot(self->context, &self->global);
+        leave_context(self->context);
+        shutdown(self->context);
+    }
+    if (self->lock) {
+        PyThread_free_lock(self->lock);
+    }
+    Py_XDECREF(self->prelude);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/* Scripts release the GIL, so calls on one Runtime are serialized here.  A
+ * host function calling back into the Runtime that is running it would
+ * wait on itself, so that is refused instead. */
+static int lock_runtime(RuntimeObject *self) {
+    if (!self->context) {
+        PyErr_Format(PyExc_RuntimeError, "Runtime is not initialized");
+        return 0;
+    }
+    if (self->owner == PyThread_get_thread_ident()) {
+        PyErr_Format(PyExc_RuntimeError, "Runtime is already running a script on this thread");
+        return 0;
+    }
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+    self->owner = PyThread_get_thread_ident();
+    return 1;
+}
+
+static void unlock_runtime(RuntimeObject *self) {
+    self->owner = 0;
+    PyThread_release_lock(self->lock);
+}
+
+static PyObject *Runtime_js(RuntimeObject *self, PyObject *args, PyObject *kwargs) {
+    struct evaluation evaluation;
+    if (!parse_evaluation(args, kwargs, &evaluation, self->jit) || !lock_runtime(self)) {
+        return NULL;
+    }
+
+    enter_context(self->context, &evaluation);
+    PyObject *result = NULL;
+    JSObject *scope = new_scope(self->context, self->global);
+    if (scope) {
+        result = evaluate(self->context, scope);
+    } else if (!PyErr_Occurred()) {
+        PyErr_Format(PyExc_SystemError, "unable to initialize JS scope\n");
+    }
+    JS_MaybeGC(self->context);
+    leave_context(self->context);
+    unlock_runtime(self);
+    return result;
+}
+
+/* Swaps in a new prelude.  It is loaded into a new template global next to
+ * the current one, which stays in place if any source fails. */
+static PyObject *Runtime_set_prelude(RuntimeObject *self, PyObject *prelude) {
+    struct evaluation evaluation;
+    PyObject *sources = normalize_prelude(prelude);
+    if (!sources) {
+        return NULL;
+    }
+    if (!lock_runtime(self)) {
+        Py_DECREF(sources);
+        return NULL;
+    }
+
+    enter_context(self->context, default_evaluation(&evaluation, self->jit));
+    JSObject *global = load_prelude(self->context, sources, 0);
+    if (global) {
+        self->global = global;
+        JS_SetGlobalObject(self->context, global);
+    }
+    JS_MaybeGC(self->context);
+    leave_context(self->context);
+    unlock_runtime(self);
+
+    if (!global) {
+        Py_DECREF(sources);
+        return NULL;
+    }
+    Py_DECREF(self->prelude);
+    self->prelude = sources;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Runtime_methods[] = {
+    {"js", (PyCFunction) Runtime_js, METH_VARARGS | METH_KEYWORDS, "execute javascript code"},
+    {"set_prelude", (PyCFunction) Runtime_set_prelude, METH_O, "replace the prelude"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef Runtime_members[] = {
+    {"prelude", T_OBJECT, offsetof(RuntimeObject, prelude), READONLY, "prelude sources"},
+    {NULL, 0, 0, 0, NULL}
+};
+
+static PyTypeObject RuntimeType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "spindly.Runtime",
+    .tp_basicsize = sizeof(RuntimeObject),
+    .tp_dealloc = (destructor) Runtime_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "javascript runtime with a preloaded prelude",
+    .tp_methods = Runtime_methods,
+    .tp_members = Runtime_members,
+    .tp_init = (initproc) Runtime_init,
+    .tp_new = PyType_GenericNew,
+};
+
+/* A Session keeps its scope between calls, so that state built up by one
+ * script is seen by the next without being passed back in as params.  It
+ * runs on a private Runtime: the prelude lives on the template global and
+ * the session's own variables on the scope in front of it. */
+typedef struct {
+    PyObject_HEAD
+    RuntimeObject *runtime;
+    JSObject *scope;
+} SessionObject;
+
+static int Session_init(SessionObject *self, PyObject *args, PyObject *kwargs) {
+    struct evaluation evaluation;
+
+    if (self->runtime) {
+        PyErr_Format(PyExc_RuntimeError, "Session is already initialized");
+        return -1;
+    }
+    self->runtime = (RuntimeObject *) PyObject_Call((PyObject *) &RuntimeType, args, kwargs);
+    if (!self->runtime) {
+        return -1;
+    }
+
+    RuntimeObject *runtime = self->runtime;
+    enter_context(runtime->context, default_evaluation(&evaluation, runtime->jit));
+    self->scope = new_scope(runtime->context, runtime->global);
+    if (self->scope && !JS_AddNamedObjectRoot(runtime->context, &self->scope, "spindly session")) {
+        self->scope = NULL;
+    }
+    leave_context(runtime->context);
+
+    if (!self->scope) {
+        Py_CLEAR(self->runtime);
+        PyErr_Format(PyExc_SystemError, "unable to initialize JS scope\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void Session_dealloc(SessionObject *self) {
+    if (self->scope) {
+        struct evaluation evaluation;
+        lock_runtime(self->runtime);
+        enter_context(self->runtime->context, default_evaluation(&evaluation, self->runtime->jit));
+        JS_RemoveObjectRoot(self->runtime->context, &self->scope);
+        leave_context(self->runtime->context);
+        unlock_runtime(self->runtime);
+    }
+    Py_XDECREF(self->runtime);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/* Takes the same arguments as js(); only the params given are (re)defined,
+ * everything else on the scope is left as the last call left it. */
+static PyObject *Session_run(SessionObject *self, PyObject *args, PyObject *kwargs) {
+    struct evaluation evaluation;
+    if (!self->scope) {
+        return PyErr_Format(PyExc_RuntimeError, "Session is not initialized");
+    }
+
+    RuntimeObject *runtime = self->runtime;
+    if (!parse_evaluation(args, kwargs, &evaluation, runtime->jit) || !lock_runtime(runtime)) {
+        return NULL;
+    }
+
+    enter_context(runtime->context, &evaluation);
+    PyObject *result = evaluate(runtime->context, self->scope);
+    JS_MaybeGC(runtime->context);
+    leave_context(runtime->context);
+    unlock_runtime(runtime);
+    return result;
+}
+
+/* Drops everything the session's scripts defined by putting a new, empty
+ * scope in front of the template global.  Nothing is re-run or copied, so
+ * this costs one object allocation; the old scope is left to the GC.
+ * Objects owned by the template (standard classes, prelude helpers) are
+ * shared, so changes scripts make inside them are not undone. */
+static PyObject *Session_reset(SessionObject *self) {
+    struct evaluation evaluation;
+    if (!self->scope) {
+        return PyErr_Format(PyExc_RuntimeError, "Session is not initialized");
+    }
+
+    RuntimeObject *runtime = self->runtime;
+    if (!lock_runtime(runtime)) {
+        return NULL;
+    }
+    enter_context(runtime->context, default_evaluation(&evaluation, runtime->jit));
+    JSObject *scope = new_scope(runtime->context, runtime->global);
+    if (scope) {
+        self->scope = scope;
+    }
+    leave_context(runtime->context);
+    unlock_runtime(runtime);
+
+    if (!scope) {
+        return PyErr_Format(PyExc_SystemError, "unable to initialize JS scope\n");
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Session_methods[] = {
+    {"run", (PyCFunction) Session_run, METH_VARARGS | METH_KEYWORDS, "execute javascript code in the session"},
+    {"reset", (PyCFunction) Session_reset, METH_NOARGS, "restore the post-prelude state"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject SessionType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "spindly.Session",
+    .tp_basicsize = sizeof(SessionObject),
+    .tp_dealloc = (destructor) Session_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "javascript scope kept between calls",
+    .tp_methods = Session_methods,
+    .tp_init = (initproc) Session_init,
+    .tp_new = PyType_GenericNew,
+};
+
+/* Entry points with options of their own pop them from a private copy of
+ * kwargs, then hand the rest to parse_evaluation. */
+static int copy_keywords(PyObject *kwargs, PyObject **copy) {
+    *copy = kwargs ? PyDict_Copy(kwargs) : NULL;
+    return kwargs == NULL || *copy != NULL;
+}
+
+static int pop_size_keyword(PyObject *kwargs, const char *name, Py_ssize_t *size) {
+    PyObject *value = kwargs ? PyDict_GetItemString(kwargs, name) : NULL;
+    if (!value) {
+        return 1;
+    }
+
+    *size = PyInt_AsSsize_t(value);
+    if (*size == -1 && PyErr_Occurred()) {
+        return 0;
+    }
+    if (*size < 1) {
+        PyErr_Format(PyExc_ValueError, "%s must be positive", name);
+        return 0;
+    }
+    return PyDict_DelItemString(kwargs, name) == 0;
+}
+
+static int pop_flag_keyword(PyObject *kwargs, const char *name, int *flag) {
+    PyObject *value = kwargs ? PyDict_GetItemString(kwargs, name) : NULL;
+    if (!value) {
+        return 1;
+    }
+
+    *flag = PyObject_IsTrue(value);
+    if (*flag < 0) {
+        return 0;
+    }
+    return PyDict_DelItemString(kwargs, name) == 0;
+}
+
+/* Encodes a request for a sandbox worker or spindlyd.  deadline, on the
+ * monotonic() clock, is only sent when set; CLOCK_MONOTONIC is shared by
+ * all processes on a host, so it means the same thing to the worker. */
+static PyObject *encode_request(PyObject *dumps, PyObject *script, PyObject *params, int timeout, double deadline) {
+    PyObject *fields = Py_BuildValue("{s:O,s:O,s:i}", "script", script, "params", params, "timeout", timeout);
+    if (fields && deadline > 0) {
+        PyObject *value = PyFloat_FromDouble(deadline);
+        if (!value || PyDict_SetItemString(fields, "deadline", value) < 0) {
+            Py_CLEAR(fields);
+        }
+        Py_XDECREF(value);
+    }
+    PyObject *request = fields ? PyObject_CallFunctionObjArgs(dumps, fields, NULL) : NULL;
+    Py_XDECREF(fields);
+    return request;
+}
+
+/* A SandboxPool runs scripts in pre-forked worker processes (see
+ * sandbox.h), trading the richer in-process conversions for isolation:
+ * params and results cross the process boundary as JSON.  Calls the pool
+ * cannot admit (max_queue, max_wait) raise Overloaded straight away. */
+static PyObject *overloaded_error;
+
+typedef struct {
+    PyObject_HEAD
+    struct sandbox *sandbox;
+    PyObject *dumps;
+    PyObject *loads;
+    int timeout;
+    int active;
+} SandboxPoolObject;
+
+/* Grace given to a worker beyond the script timeout before it is killed. */
+#define SANDBOX_GRACE_MS 5000
+
+static int SandboxPool_init(SandboxPoolObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"workers", "prelude", "max_calls", "max_rss", "ring_size", "timeout", "max_queue",
+        "max_wait", NULL};
+    struct sandbox_options options = {4, 1 << 20, 0, 0, NULL, 0, 0, 0};
+    unsigned long max_rss = 0;
+    double max_wait = 0;
+    PyObject *prelude = NULL;
+
+    self->timeout = 10;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iOkkIiid:SandboxPool", kwlist, &options.workers,
+            &prelude, &options.max_calls, &max_rss, &options.ring_size, &self->timeout, &options.max_queue,
+            &max_wait)) {
+        return -1;
+    }
+    if (self->sandbox) {
+        PyErr_Format(PyExc_RuntimeError, "SandboxPool is already initialized");
+        return -1;
+    }
+    if (options.workers < 1 || options.ring_size < 64) {
+        PyErr_Format(PyExc_ValueError, "workers must be positive and ring_size at least 64");
+        return -1;
+    }
+    if (options.max_queue < 0 || max_wait < 0) {
+        PyErr_Format(PyExc_ValueError, "max_queue and max_wait must not be negative");
+        return -1;
+    }
+    options.max_rss = max_rss;
+    options.max_wait_ms = max_wait > 0 && max_wait < 0.001 ? 1 : (int) (max_wait * 1000);
+
+    PyObject *json = PyImport_ImportModule("json");
+    if (!json) {
+        return -1;
+    }
+    Py_XDECREF(self->dumps);
+    Py_XDECREF(self->loads);
+    self->dumps = PyObject_GetAttrString(json, "dumps");
+    self->loads = PyObject_GetAttrString(json, "loads");
+    Py_DECREF(json);
+    if (!self->dumps || !self->loads) {
+        return -1;
+    }
+
+    /* The prelude is checked in process, so that a broken one raises here
+     * rather than crashing every worker as it warms up. */
+    PyObject *sources = normalize_prelude(prelude);
+    if (!sources) {
+        return -1;
+    }
+    PyObject *check = PyObject_CallFunctionObjArgs((PyObject *) &RuntimeType, sources, NULL);
+    PyObject *encoded = check ? PyObject_CallFunctionObjArgs(self->dumps, sources, NULL) : NULL;
+    Py_XDECREF(check);
+    Py_DECREF(sources);
+    if (!encoded) {
+        return -1;
+    }
+    options.prelude = PyString_AS_STRING(encoded);
+    options.prelude_length = PyString_GET_SIZE(encoded);
+
+    self->sandbox = sandbox_open(&options);
+    Py_DECREF(encoded);
+    if (!self->sandbox) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+static void SandboxPool_dealloc(SandboxPoolObject *self) {
+    if (self->sandbox) {
+        Py_BEGIN_ALLOW_THREADS
+        sandbox_close(self->sandbox);
+        Py_END_ALLOW_THREADS
+    }
+    Py_XDECREF(self->dumps);
+    Py_XDECREF(self->loads);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *SandboxPool_js(SandboxPoolObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"script", "params", "timeout", "priority", "tenant", "deadline", NULL};
+    PyObject *script, *params = Py_None;
+    int timeout = self->timeout, priority = 1;
+    const char *tenant = NULL;
+    double deadline = 0;
+    enum sandbox_status status;
+    char *response;
+    size_t length;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Oiizd:js", kwlist, &script, &params, &timeout, &priority,
+            &tenant, &deadline)) {
+        return NULL;
+    }
+    if (!self->sandbox) {
+        return PyErr_Format(PyExc_RuntimeError, "SandboxPool is closed");
+    }
+    if (priority < 0 || priority >= SANDBOX_PRIORITIES) {
+        return PyErr_Format(PyExc_ValueError, "priority must be between 0 and %d", SANDBOX_PRIORITIES - 1);
+    }
+
+    /* The worker stops the script itself; the host only gives up on it a
+     * grace period after the sooner of the timeout and the deadline. */
+    long timeout_ms = timeout > 0 ? timeout * 1000L : -1;
+    int wait_ms, error;
+    if (deadline > 0) {
+        long remaining = (long) ((deadline - monotonic_seconds()) * 1000);
+        if (remaining <= 0) {
+            return PyErr_Format(PyExc_ValueError, "deadline exceeded");
+        }
+        timeout_ms = timeout_ms < 0 || remaining < timeout_ms ? remaining : timeout_ms;
+    }
+    if (timeout_ms < 0) {
+        wait_ms = -1;
+    } else if (timeout_ms > INT_MAX - SANDBOX_GRACE_MS) {
+        wait_ms = INT_MAX;
+    } else {
+        wait_ms = (int) timeout_ms + SANDBOX_GRACE_MS;
+    }
+
+    PyObject *request = encode_request(self->dumps, script, params, timeout, deadline);
+    if (!request) {
+        return NULL;
+    }
+
+    self->active++;
+    Py_BEGIN_ALLOW_THREADS
+    status = sandbox_call(self->sandbox, PyString_AS_STRING(request), PyString_GET_SIZE(request),
+        wait_ms, deadline, priority, tenant, &response, &length);
+    error = errno;
+    Py_END_ALLOW_THREADS
+    self->active--;
+    Py_DECREF(request);
+
+    PyObject *result = NULL;
+    switch (status) {
+    case SANDBOX_OK: {
+        PyObject *encoded = PyString_FromStringAndSize(response, length);
+        if (encoded) {
+            result = PyObject_CallFunctionObjArgs(self->loads, encoded, NULL);
+            Py_DECREF(encoded);
+        }
+        break;
+    }
+    case SANDBOX_SCRIPT_ERROR:
+        PyErr_Format(PyExc_ValueError, "%s", response);
+        break;
+    case SANDBOX_TIMEOUT:
+        PyErr_Format(PyExc_ValueError, "sandbox worker did not respond in time");
+        break;
+    case SANDBOX_CRASHED:
+        PyErr_Format(PyExc_RuntimeError, "sandbox worker crashed");
+        break;
+    case SANDBOX_OVERLOADED:
+        PyErr_Format(overloaded_error, "sandbox pool is overloaded");
+        break;
+    case SANDBOX_DEADLINE_EXCEEDED:
+        PyErr_Format(PyExc_ValueError, "deadline exceeded");
+        break;
+    default:
+        errno = error;
+        PyErr_SetFromErrno(PyExc_OSError);
+    }
+    free(response);
+    return result;
+}
+
+static PyObject *SandboxPool_close(SandboxPoolObject *self) {
+    if (self->active > 0) {
+        return PyErr_Format(PyExc_RuntimeError, "SandboxPool has calls in progress");
+    }
+    if (self->sandbox) {
+        struct sandbox *sandbox = self->sandbox;
+        self->sandbox = NULL;
+        Py_BEGIN_ALLOW_THREADS
+        sandbox_close(sandbox);
+        Py_END_ALLOW_THREADS
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *SandboxPool_stats(SandboxPoolObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"reset", NULL};
+    struct sandbox_stats stats;
+    int reset = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:stats", kwlist, &reset)) {
+        return NULL;
+    }
+    if (!self->sandbox) {
+        return PyErr_Format(PyExc_RuntimeError, "SandboxPool is closed");
+    }
+    sandbox_stats(self->sandbox, &stats, reset);
+    return Py_BuildValue("{s:k,s:k,s:i,s:d,s:d}", "calls", stats.calls, "rejected", stats.rejected,
+        "queued", stats.queued, "wait_seconds", stats.wait_seconds, "max_wait_seconds", stats.max_wait_seconds);
+}
+
+static PyObject *SandboxPool_set_weight(SandboxPoolObject *self, PyObject *args) {
+    const char *tenant;
+    double weight;
+
+    if (!PyArg_ParseTuple(args, "sd:set_weight", &tenant, &weight)) {
+        return NULL;
+    }
+    if (!self->sandbox) {
+        return PyErr_Format(PyExc_RuntimeError, "SandboxPool is closed");
+    }
+    if (weight <= 0) {
+        return PyErr_Format(PyExc_ValueError, "weight must be positive");
+    }
+    if (sandbox_set_weight(self->sandbox, tenant, weight) < 0) {
+        return PyErr_Format(PyExc_ValueError, "too many tenants");
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *SandboxPool_tenants(SandboxPoolObject *self) {
+    struct sandbox_tenant_stats stats[SANDBOX_MAX_TENANTS];
+    int count, i;
+
+    if (!self->sandbox) {
+        return PyErr_Format(PyExc_RuntimeError, "SandboxPool is closed");
+    }
+    count = sandbox_tenant_stats(self->sandbox, stats, SANDBOX_MAX_TENANTS);
+
+    PyObject *tenants = PyDict_New();
+    if (!tenants) {
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        PyObject *entry = Py_BuildValue("{s:d,s:k,s:k,s:d,s:d}", "weight", stats[i].weight,
+            "calls", stats[i].calls, "rejected", stats[i].rejected, "cpu_seconds", stats[i].cpu_seconds,
+            "wait_seconds", stats[i].wait_seconds);
+        if (!entry || PyDict_SetItemString(tenants, stats[i].name, entry) < 0) {
+            Py_XDECREF(entry);
+            Py_DECREF(tenants);
+            return NULL;
+        }
+        Py_DECREF(entry);
+    }
+    return tenants;
+}
+
+static PyMethodDef SandboxPool_methods[] = {
+    {"js", (PyCFunction) SandboxPool_js, METH_VARARGS | METH_KEYWORDS, "execute javascript code in a worker"},
+    {"stats", (PyCFunction) SandboxPool_stats, METH_VARARGS | METH_KEYWORDS, "admission counters"},
+    {"set_weight", (PyCFunction) SandboxPool_set_weight, METH_VARARGS, "set a tenant's fair share weight"},
+    {"tenants", (PyCFunction) SandboxPool_tenants, METH_NOARGS, "counters per tenant"},
+    {"close", (PyCFunction) SandboxPool_close, METH_NOARGS, "stop all workers"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject SandboxPoolType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "spindly.SandboxPool",
+    .tp_basicsize = sizeof(SandboxPoolObject),
+    .tp_dealloc = (destructor) SandboxPool_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "pool of pre-forked worker processes running javascript",
+    .tp_methods = SandboxPool_methods,
+    .tp_init = (initproc) SandboxPool_init,
+    .tp_new = PyType_GenericNew,
+};
+
+/* A Client talks to a spindlyd daemon (see spindlyd.c) over its Unix
+ * domain socket: one JSON request frame per call, answered on the same
+ * connection.  Calls from several threads take turns.  Responses larger
+ * than max_frame bytes are refused with EMSGSIZE. */
+typedef struct {
+    PyObject_HEAD
+    int fd;
+    PyObject *dumps;
+    PyObject *loads;
+    int timeout;
+    Py_ssize_t max_frame;
+    PyThread_type_lock lock;
+} ClientObject;
+
+#define CLIENT_MAX_FRAME (64 * 1024 * 1024)
+
+static int Client_init(ClientObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"path", "timeout", "max_frame", NULL};
+    const char *path;
+
+    self->timeout = 10;
+    self->max_frame = CLIENT_MAX_FRAME;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|in:Client", kwlist, &path, &self->timeout,
+            &self->max_frame)) {
+        return -1;
+    }
+    if (self->max_frame <= 0) {
+        PyErr_Format(PyExc_ValueError, "max_frame must be positive");
+        return -1;
+    }
+    if (self->lock) {
+        PyErr_Format(PyExc_RuntimeError, "Client is already initialized");
+        return -1;
+    }
+
+    PyObject *json = PyImport_ImportModule("json");
+    if (!json) {
+        return -1;
+    }
+    self->dumps = PyObject_GetAttrString(json, "dumps");
+    self->loads = PyObject_GetAttrString(json, "loads");
+    Py_DECREF(json);
+    if (!self->dumps || !self->loads) {
+        return -1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    self->fd = frame_connect(path);
+    Py_END_ALLOW_THREADS
+    if (self->fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *) path);
+        return -1;
+    }
+
+    self->lock = PyThread_allocate_lock();
+    if (!self->lock) {
+        close(self->fd);
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+static void Client_dealloc(ClientObject *self) {
+    if (self->lock) {
+        if (self->fd >= 0) {
+            close(self->fd);
+        }
+        PyThread_free_lock(self->lock);
+    }
+    Py_XDECREF(self->dumps);
+    Py_XDECREF(self->loads);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *Client_js(ClientObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"script", "params", "timeout", "deadline", NULL};
+    PyObject *script, *params = Py_None;
+    int timeout = self->timeout;
+    double deadline = 0;
+    char *response = NULL;
+    size_t length;
+    int retval;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Oid:js", kwlist, &script, &params, &timeout, &deadline)) {
+        return NULL;
+    }
+    if (!self->lock) {
+        return PyErr_Format(PyExc_RuntimeError, "Client is not connected");
+    }
+
+    PyObject *request = encode_request(self->dumps, script, params, timeout, deadline);
+    if (!request) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    retval = -1;
+    errno = EBADF;
+    if (self->fd >= 0) {
+        retval = frame_write(self->fd, PyString_AS_STRING(request), PyString_GET_SIZE(request));
+        if (retval > 0) {
+            retval = frame_read(self->fd, &response, &length, self->max_frame);
+        }
+        if (retval <= 0) {
+            /* a half-finished exchange leaves the stream out of step */
+            int saved = retval == 0 ? ECONNRESET : errno;
+            close(self->fd);
+            self->fd = -1;
+            errno = saved;
+        }
+    }
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(request);
+
+    if (retval <= 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    PyObject *result = NULL;
+    if (length > 0 && response[0] == 'R') {
+        PyObject *encoded = PyString_FromStringAndSize(response + 1, length - 1);
+        if (encoded) {
+            result = PyObject_CallFunctionObjArgs(self->loads, encoded, NULL);
+            Py_DECREF(encoded);
+        }
+    } else if (length > 0 && response[0] == 'E') {
+        PyObject *message = PyString_FromStringAndSize(response + 1, length - 1);
+        if (message) {
+            PyErr_SetObject(PyExc_ValueError, message);
+            Py_DECREF(message);
+        }
+    } else {
+        PyErr_Format(PyExc_SystemError, "malformed response from spindlyd");
+    }
+    free(response);
+    return result;
+}
+
+static PyObject *Client_close(ClientObject *self) {
+    if (self->lock) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        if (self->fd >= 0) {
+            close(self->fd);
+            self->fd = -1;
+        }
+        PyThread_release_lock(self->lock);
+        Py_END_ALLOW_THREADS
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Client_methods[] = {
+    {"js", (PyCFunction) Client_js, METH_VARARGS | METH_KEYWORDS, "execute javascript code in spindlyd"},
+    {"close", (PyCFunction) Client_close, METH_NOARGS, "close the connection"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject ClientType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "spindly.Client",
+    .tp_basicsize = sizeof(ClientObject),
+    .tp_dealloc = (destructor) Client_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "connection to a spindlyd daemon",
+    .tp_methods = Client_methods,
+    .tp_init = (initproc) Client_init,
+    .tp_new = PyType_GenericNew,
+};
+
+/* Values emitted by a streaming script travel through a channel: a bounded
+ * queue shared by the thread running the script and the Stream yielding
+ * them.  A full queue blocks emit() until the consumer catches up, and
+ * whichever side lets go of the channel last frees it. */
+struct channel {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    PyObject **values;
+    Py_ssize_t capacity;
+    Py_ssize_t head;
+    Py_ssize_t count;
+    int references;
+    int closed;
+    int finished;
+    JSContext *context;
+    PyObject *result;
+    PyObject *error_type;
+    PyObject *error_value;
+    PyObject *error_traceback;
+};
+
+#define DEFAULT_STREAM_BUFFER 1024
+
+static struct channel *new_channel(Py_ssize_t capacity) {
+    struct channel *channel = PyMem_Malloc(sizeof(struct channel));
+    if (!channel) {
+        return NULL;
+    }
+    memset(channel, 0, sizeof(struct channel));
+
+    channel->values = PyMem_Malloc(sizeof(PyObject *) * capacity);
+    if (!channel->values) {
+        PyMem_Free(channel);
+        return NULL;
+    }
+    channel->capacity = capacity;
+    channel->references = 1;
+    pthread_mutex_init(&channel->mutex, NULL);
+    pthread_cond_init(&channel->changed, NULL);
+    return channel;
+}
+
+/* Called with the GIL held. */
+static void release_channel(struct channel *channel) {
+    pthread_mutex_lock(&channel->mutex);
+    int references = --channel->references;
+    pthread_mutex_unlock(&channel->mutex);
+    if (references > 0) {
+        return;
+    }
+
+    while (channel->count > 0) {
+        Py_DECREF(channel->values[channel->head]);
+        channel->head = (channel->head + 1) % channel->capacity;
+        channel->count--;
+    }
+    Py_XDECREF(channel->result);
+    Py_XDECREF(channel->error_type);
+    Py_XDECREF(channel->error_value);
+    Py_XDECREF(channel->error_traceback);
+    pthread_cond_destroy(&channel->changed);
+    pthread_mutex_destroy(&channel->mutex);
+    PyMem_Free(channel->values);
+    PyMem_Free(channel);
+}
+
+static void free_channel_capsule(PyObject *capsule) {
+    release_channel(PyCapsule_GetPointer(capsule, "spindly.channel"));
+}
+
+/* The emit() callable of a streaming script.  Time spent waiting for the
+ * consumer does not count against the timeout, though the deadline holds. */
+static PyObject *put_channel(PyObject *capsule, PyObject *value) {
+    struct channel *channel = PyCapsule_GetPointer(capsule, "spindly.channel");
+    int closed;
+
+    Py_INCREF(value);
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&channel->mutex);
+    if (channel->count == channel->capacity && !channel->closed) {
+        struct evaluation *evaluation = JS_GetContextPrivate(channel->context);
+        double started = monotonic_seconds();
+        while (channel->count == channel->capacity && !channel->closed) {
+            pthread_cond_wait(&channel->changed, &channel->mutex);
+        }
+        if (evaluation->expires > 0) {
+            double expires = evaluation->expires + monotonic_seconds() - started;
+            if (evaluation->deadline > 0 && evaluation->deadline < expires) {
+                expires = evaluation->deadline;
+            }
+            evaluation->expires = expires;
+        }
+    }
+    closed = channel->closed;
+    if (!closed) {
+        channel->values[(channel->head + channel->count) % channel->capacity] = value;
+        channel->count++;
+        pthread_cond_broadcast(&channel->changed);
+    }
+    pthread_mutex_unlock(&channel->mutex);
+    Py_END_ALLOW_THREADS
+
+    if (closed) {
+        Py_DECREF(value);
+        return PyErr_Format(PyExc_RuntimeError, "stream was closed");
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef put_channel_def = {"emit", (PyCFunction) put_channel, METH_O, "emit a value"};
+
+/* Stops the script feeding the channel, if it is still running.  Called
+ * with the channel's mutex held. */
+static void cancel_channel(struct channel *channel) {
+    channel->closed = 1;
+    if (channel->context) {
+        struct evaluation *evaluation = JS_GetContextPrivate(channel->context);
+        evaluation->cancelled = 1;
+        JS_TriggerOperationCallback(channel->context);
+    }
+    pthread_cond_broadcast(&channel->changed);
+}
+
+struct stream_job {
+    struct channel *channel;
+    struct evaluation evaluation;
+    PyObject *args;
+    PyObject *kwargs;
+};
+
+static void *run_stream(void *ptr) {
+    struct stream_job *job = (struct stream_job *) ptr;
+    struct channel *channel = job->channel;
+    PyGILState_STATE state = PyGILState_Ensure();
+    PyObject *result = NULL;
+
+    JSContext *context = new_context();
+    if (context) {
+        enter_context(context, &job->evaluation);
+        pthread_mutex_lock(&channel->mutex);
+        channel->context = context;
+        int closed = channel->closed;
+        pthread_mutex_unlock(&channel->mutex);
+
+        JSObject *global = closed ? NULL : new_global(context);
+        if (global) {
+            result = evaluate(context, global);
+        } else if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_RuntimeError, "stream was closed");
+        }
+
+        pthread_mutex_lock(&channel->mutex);
+        channel->context = NULL;
+        pthread_mutex_unlock(&channel->mutex);
+        leave_context(context);
+        shutdown(context);
+    }
+
+    if (!result) {
+        PyErr_Fetch(&channel->error_type, &channel->error_value, &channel->error_traceback);
+    }
+    pthread_mutex_lock(&channel->mutex);
+    channel->result = result;
+    channel->finished = 1;
+    pthread_cond_broadcast(&channel->changed);
+    pthread_mutex_unlock(&channel->mutex);
+
+    Py_XDECREF(job->evaluation.emit);
+    Py_DECREF(job->args);
+    Py_XDECREF(job->kwargs);
+    PyMem_Free(job);
+    release_channel(channel);
+    PyGILState_Release(state);
+    return NULL;
+}
+
+/* Iterator over the values a script passes to emit().  The script runs on
+ * its own thread as soon as the stream is created; the final return value
+ * is available as result once the stream is exhausted. */
+typedef struct {
+    PyObject_HEAD
+    struct channel *channel;
+} StreamObject;
+
+static void Stream_dealloc(StreamObject *self) {
+    struct channel *channel = self->channel;
+    if (channel) {
+        pthread_mutex_lock(&channel->mutex);
+        cancel_channel(channel);
+        pthread_mutex_unlock(&channel->mutex);
+        release_channel(channel);
+    }
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *Stream_iternext(StreamObject *self) {
+    struct channel *channel = self->channel;
+    PyObject *value = NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&channel->mutex);
+    while (channel->count == 0 && !channel->finished) {
+        pthread_cond_wait(&channel->changed, &channel->mutex);
+    }
+    if (channel->count > 0) {
+        value = channel->values[channel->head];
+        channel->head = (channel->head + 1) % channel->capacity;
+        channel->count--;
+        pthread_cond_broadcast(&channel->changed);
+    }
+    pthread_mutex_unlock(&channel->mutex);
+    Py_END_ALLOW_THREADS
+
+    if (!value && channel->error_type) {
+        PyErr_Restore(channel->error_type, channel->error_value, channel->error_traceback);
+        channel->error_type = channel->error_value = channel->error_traceback = NULL;
+    }
+    return value;
+}
+
+static PyObject *Stream_get_result(StreamObject *self, void *closure) {
+    PyObject *result = self->channel->finished && self->channel->result ? self->channel->result : Py_None;
+    Py_INCREF(result);
+    return result;
+}
+
+static PyGetSetDef Stream_getset[] = {
+    {"result", (getter) Stream_get_result, NULL, "script result, once the stream is exhausted", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject StreamType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "spindly.Stream",
+    .tp_basicsize = sizeof(StreamObject),
+    .tp_dealloc = (destructor) Stream_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "values emitted by a streaming script",
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc) Stream_iternext,
+    .tp_getset = Stream_getset,
+};
+
+/* submit() runs a call on its own thread the way stream() does, and
+ * returns a Call handle to it.  The handle's cancel() interrupts the script
+ * from whichever thread calls it, through the same operation callback the
+ * watchdog uses; Python 2 has no asyncio, so the handle follows the shape
+ * of a future instead. */
+static PyObject *cancelled_error;
+
+typedef struct {
+    PyObject_HEAD
+    struct channel *channel;
+} CallObject;
+
+static void Call_dealloc(CallObject *self) {
+    if (self->channel) {
+        release_channel(self->channel);
+    }
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/* Returns True if the call was still running and has been interrupted. */
+static PyObject *Call_cancel(CallObject *self) {
+    struct channel *channel = self->channel;
+    pthread_mutex_lock(&channel->mutex);
+    int running = !channel->finished && !channel->closed;
+    if (running) {
+        cancel_channel(channel);
+    }
+    pthread_mutex_unlock(&channel->mutex);
+    return PyBool_FromLong(running);
+}
+
+static PyObject *Call_done(CallObject *self) {
+    struct channel *channel = self->channel;
+    pthread_mutex_lock(&channel->mutex);
+    int finished = channel->finished;
+    pthread_mutex_unlock(&channel->mutex);
+    return PyBool_FromLong(finished);
+}
+
+static PyObject *Call_cancelled(CallObject *self) {
+    struct channel *channel = self->channel;
+    pthread_mutex_lock(&channel->mutex);
+    int closed = channel->closed;
+    pthread_mutex_unlock(&channel->mutex);
+    return PyBool_FromLong(closed);
+}
+
+/* Waits for the call (at most timeout seconds, unless None) and returns its
+ * result or raises its error; a cancelled call raises Cancelled. */
+static PyObject *Call_result(CallObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"timeout", NULL};
+    struct channel *channel = self->channel;
+    PyObject *timeout = Py_None;
+    struct timespec deadline;
+    int finished;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:result", kwlist, &timeout)) {
+        return NULL;
+    }
+    double seconds = timeout == Py_None ? -1 : PyFloat_AsDouble(timeout);
+    if (seconds == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (seconds >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t) seconds;
+        deadline.tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&channel->mutex);
+    while (!channel->finished) {
+        if (seconds < 0) {
+            pthread_cond_wait(&channel->changed, &channel->mutex);
+        } else if (pthread_cond_timedwait(&channel->changed, &channel->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    finished = channel->finished;
+    pthread_mutex_unlock(&channel->mutex);
+    Py_END_ALLOW_THREADS
+
+    if (!finished) {
+        return PyErr_Format(PyExc_RuntimeError, "call did not finish in time");
+    }
+    if (channel->closed) {
+        return PyErr_Format(cancelled_error, "call was cancelled");
+    }
+    if (channel->error_type) {
+        Py_INCREF(channel->error_type);
+        Py_XINCREF(channel->error_value);
+        Py_XINCREF(channel->error_traceback);
+        PyErr_Restore(channel->error_type, channel->error_value, channel->error_traceback);
+        return NULL;
+    }
+    PyObject *result = channel->result ? channel->result : Py_None;
+    Py_INCREF(result);
+    return result;
+}
+
+static PyMethodDef Call_methods[] = {
+    {"cancel", (PyCFunction) Call_cancel, METH_NOARGS, "interrupt the call"},
+    {"done", (PyCFunction) Call_done, METH_NOARGS, "whether the call has finished"},
+    {"cancelled", (PyCFunction) Call_cancelled, METH_NOARGS, "whether the call was cancelled"},
+    {"result", (PyCFunction) Call_result, METH_VARARGS | METH_KEYWORDS, "wait for the call's result"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject CallType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "spindly.Call",
+    .tp_basicsize = sizeof(CallObject),
+    .tp_dealloc = (destructor) Call_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "handle to a call running in the background",
+    .tp_methods = Call_methods,
+};
+
+static PyObject *spindly_submit(PyObject *self, PyObject *args, PyObject *kwargs) {
+    struct stream_job *job;
+    pthread_t tid;
+
+    job = PyMem_Malloc(sizeof(struct stream_job));
+    if (!job) {
+        return PyErr_NoMemory();
+    }
+    if (!parse_evaluation(args, kwargs, &job->evaluation, 0)) {
+        PyMem_Free(job);
+        return NULL;
+    }
+    job->channel = new_channel(1);
+    if (!job->channel) {
+        PyMem_Free(job);
+        return PyErr_NoMemory();
+    }
+
+    CallObject *call = PyObject_New(CallObject, &CallType);
+    if (!call) {
+        release_channel(job->channel);
+        PyMem_Free(job);
+        return NULL;
+    }
+    call->channel = job->channel;
+    job->channel->references++;
+    job->args = args;
+    job->kwargs = kwargs;
+    Py_INCREF(args);
+    Py_XINCREF(kwargs);
+    Py_XINCREF(job->evaluation.emit);
+
+    if (pthread_create(&tid, NULL, run_stream, job) != 0) {
+        Py_XDECREF(job->evaluation.emit);
+        release_channel(job->channel);
+        PyMem_Free(job);
+        Py_DECREF(args);
+        Py_XDECREF(kwargs);
+        Py_DECREF(call);
+        return PyErr_Format(PyExc_SystemError, "unable to start call thread\n");
+    }
+    pthread_detach(tid);
+    return (PyObject *) call;
+}
+
+/* stream() takes the arguments of js() plus buffer, the number of emitted
+ * values that may be waiting before emit() blocks. */
+static PyObject *spindly_stream(PyObject *self, PyObject *args, PyObject *kwargs) {
+    Py_ssize_t buffer = DEFAULT_STREAM_BUFFER;
+    struct stream_job *job;
+    pthread_t tid;
+
+    if (!copy_keywords(kwargs, &kwargs)) {
+        return NULL;
+    }
+    if (!pop_size_keyword(kwargs, "buffer", &buffer)) {
+        Py_XDECREF(kwargs);
+        return NULL;
+    }
+
+    job = PyMem_Malloc(sizeof(struct stream_job));
+    if (!job) {
+        Py_XDECREF(kwargs);
+        return PyErr_NoMemory();
+    }
+    job->args = args;
+    job->kwargs = kwargs;
+    Py_INCREF(args);
+    if (!parse_evaluation(args, kwargs, &job->evaluation, 0)) {
+        goto error;
+    }
+    if (job->evaluation.emit != NULL) {
+        PyErr_Format(PyExc_TypeError, "stream() provides emit itself");
+        goto error;
+    }
+
+    job->channel = new_channel(buffer);
+    if (!job->channel) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    PyObject *capsule = PyCapsule_New(job->channel, "spindly.channel", free_channel_capsule);
+    if (!capsule) {
+        release_channel(job->channel);
+        goto error;
+    }
+    job->channel->references++;
+    job->evaluation.emit = PyCFunction_New(&put_channel_def, capsule);
+    Py_DECREF(capsule);
+    if (!job->evaluation.emit) {
+        release_channel(job->channel);
+        goto error;
+    }
+
+    StreamObject *stream = PyObject_New(StreamObject, &StreamType);
+    if (!stream) {
+        release_channel(job->channel);
+        Py_DECREF(job->evaluation.emit);
+        goto error;
+    }
+    stream->channel = job->channel;
+    job->channel->references++;
+
+    if (pthread_create(&tid, NULL, run_stream, job) != 0) {
+        Py_DECREF(job->evaluation.emit);
+        release_channel(job->channel);
+        PyMem_Free(job);
+        Py_DECREF(args);
+        Py_XDECREF(kwargs);
+        Py_DECREF(stream);
+        return PyErr_Format(PyExc_SystemError, "unable to start stream thread\n");
+    }
+    pthread_detach(tid);
+    return (PyObject *) stream;
+
+error:
+    Py_DECREF(args);
+    Py_XDECREF(kwargs);
+    PyMem_Free(job);
+    return NULL;
+}
+
+/* Functions compiled once into their own runtime.  The reserved roots
+ * start with the runner's fixed slots, the compiled functions and any
+ * state, followed by one slot per record or result of a chunk, so that a
+ * chunk is converted straight into rooted arguments.  A mapping runner calls
+ * MAP_FUNCTION on every record; a folding runner replaces AGGREGATE_STATE
+ * with AGGREGATE_STEP(state, record). */
+struct map_runner {
+    JSContext *context;
+    JSObject *global;
+    struct evaluation evaluation;
+    size_t base;
+    Py_ssize_t slots;
+    Py_ssize_t chunk_size;
+    int fold;
+};
+
+enum {MAP_FUNCTION, MAP_SLOTS};
+enum {AGGREGATE_INIT, AGGREGATE_STEP, AGGREGATE_MERGE, AGGREGATE_STATE, AGGREGATE_SLOTS};
+
+#define DEFAULT_CHUNK_SIZE 256
+
+/* Compiles a function source, which is evaluated as an expression. */
+static JSBool compile_map_function(struct map_runner *runner, PyObject *source, Py_ssize_t slot) {
+    jsval function;
+
+    PyObject *encoded = PyUnicode_Check(source) ? PyUnicode_AsUTF8String(source) : source;
+    if (!encoded) {
+        return JS_FALSE;
+    }
+    PyObject *expression = PyString_FromFormat("(%s)", PyString_AsString(encoded));
+    if (encoded != source) {
+        Py_DECREF(encoded);
+    }
+    if (!expression) {
+        return JS_FALSE;
+    }
+    JSBool ok = run_script(runner->context, runner->global, PyString_AS_STRING(expression),
+        PyString_GET_SIZE(expression), "spindly", &function);
+    Py_DECREF(expression);
+    if (!ok) {
+        return JS_FALSE;
+    }
+
+    if (!JSVAL_IS_OBJECT(function) || JSVAL_IS_NULL(function)
+            || !JS_ObjectIsFunction(runner->context, JSVAL_TO_OBJECT(function))) {
+        PyErr_Format(PyExc_TypeError, "map source must evaluate to a function");
+        return JS_FALSE;
+    }
+    get_runtime_data(runner->context)->roots[runner->base + slot] = function;
+    return JS_TRUE;
+}
+
+static void close_map_runner(struct map_runner *runner) {
+    if (runner->context) {
+        enter_context(runner->context, &runner->evaluation);
+        if (runner->evaluation.hosts) {
+            free_host_functions(&runner->evaluation);
+        }
+        leave_context(runner->context);
+        shutdown(runner->context);
+        runner->context = NULL;
+    }
+}
+
+/* Opens a runner with sources, a tuple of function sources compiled into
+ * the first slots.  A folding runner starts from the result of init(). */
+static int open_map_runner(struct map_runner *runner, struct evaluation *evaluation, Py_ssize_t chunk_size,
+        PyObject *sources, int fold) {
+    Py_ssize_t i;
+
+    memset(runner, 0, sizeof(struct map_runner));
+    runner->evaluation = *evaluation;
+    runner->chunk_size = chunk_size;
+    runner->fold = fold;
+    runner->slots = fold ? AGGREGATE_SLOTS : MAP_SLOTS;
+
+    runner->context = new_context();
+    if (!runner->context) {
+        return 0;
+    }
+
+    enter_context(runner->context, &runner->evaluation);
+    runner->global = new_global(runner->context);
+    JSBool ok = runner->global && reserve_roots(runner->context, runner->slots + chunk_size, &runner->base)
+        && prepare_scope(runner->context, runner->global);
+    for (i = 0; ok && i < PyTuple_GET_SIZE(sources); i++) {
+        ok = compile_map_function(runner, PyTuple_GET_ITEM(sources, i), i);
+    }
+    if (ok && fold) {
+        jsval *roots = get_runtime_data(runner->context)->roots + runner->base;
+        jsval state;
+        ok = JS_CallFunctionValue(runner->context, runner->global, roots[AGGREGATE_INIT], 0, NULL, &state);
+        if (ok) {
+            get_runtime_data(runner->context)->roots[runner->base + AGGREGATE_STATE] = state;
+        } else {
+            JS_ClearPendingException(runner->context);
+        }
+    }
+    leave_context(runner->context);
+
+    if (!ok) {
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_SystemError, "unable to initialize map\n");
+        }
+        close_map_runner(runner);
+        return 0;
+    }
+    return 1;
+}
+
+/* Converts a list of at most chunk_size records and calls the runner's
+ * function on each with the GIL released.  Returns the list of converted
+ * results, or an empty list when folding. */
+static PyObject *run_map_chunk(struct map_runner *runner, PyObject *records) {
+    JSContext *context = runner->context;
+    struct runtime_data *data = get_runtime_data(context);
+    struct evaluation *evaluation = &runner->evaluation;
+    Py_ssize_t count = PyList_GET_SIZE(records), called = 0, i;
+    struct watchdog *wd = NULL;
+    PyObject *results = NULL;
+
+    enter_context(context, evaluation);
+    for (i = 0; i < count; i++) {
+        jsval value;
+        if (!to_javascript_object(context, PyList_GET_ITEM(records, i), &value)) {
+            if (!PyErr_Occurred()) {
+                PyErr_Format(PyExc_SystemError, "unable to convert record\n");
+            }
+            goto done;
+        }
+        data->roots[runner->base + runner->slots + i] = value;
+    }
+
+    if (!start_watchdog(context, evaluation, &wd)) {
+        goto done;
+    }
+
+    int mode = jit_mode(evaluation->jit);
+    double started = monotonic_seconds();
+    Py_BEGIN_ALLOW_THREADS
+    for (called = 0; called < count; called++) {
+        jsval *roots = data->roots + runner->base, result;
+        if (runner->fold) {
+            jsval arguments[2] = {roots[AGGREGATE_STATE], roots[runner->slots + called]};
+            if (!JS_CallFunctionValue(context, runner->global, roots[AGGREGATE_STEP], 2, arguments, &result)) {
+                break;
+            }
+            data->roots[runner->base + AGGREGATE_STATE] = result;
+        } else {
+            jsval argument = roots[runner->slots + called];
+            if (!JS_CallFunctionValue(context, runner->global, roots[MAP_FUNCTION], 1, &argument, &result)) {
+                break;
+            }
+            data->roots[runner->base + runner->slots + called] = result;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    jit_metrics[mode].runs += called;
+    jit_metrics[mode].seconds += monotonic_seconds() - started;
+    if (wd) {
+        shutdown_watchdog(wd);
+    }
+
+    if (called < count || evaluation->error) {
+        JS_ClearPendingException(context);
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_ValueError, "spindly: script terminated");
+        }
+        goto done;
+    }
+
+    results = PyList_New(runner->fold ? 0 : count);
+    for (i = 0; results && !runner->fold && i < count; i++) {
+        PyObject *result = to_python_object(context, data->roots[runner->base + runner->slots + i]);
+        if (!result) {
+            if (!PyErr_Occurred()) {
+                PyErr_Format(PyExc_SystemError, "unable to convert result\n");
+            }
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, i, result);
+    }
+
+done:
+    for (i = 0; i < count; i++) {
+        data->roots[runner->base + runner->slots + i] = JSVAL_VOID;
+    }
+    leave_context(context);
+    return results;
+}
+
+/* Pulls up to size records from iterator into a new list. */
+static PyObject *next_chunk(PyObject *iterator, Py_ssize_t size) {
+    PyObject *records = PyList_New(0);
+    while (records && PyList_GET_SIZE(records) < size) {
+        PyObject *record = PyIter_Next(iterator);
+        if (!record) {
+            if (PyErr_Occurred()) {
+                Py_CLEAR(records);
+            }
+            break;
+        }
+        if (PyList_Append(records, record) < 0) {
+            Py_CLEAR(records);
+        }
+        Py_DECREF(record);
+    }
+    return records;
+}
+
+/* The map entry points take count function sources and the iterable
+ * positionally, followed by the options of js().  The sources after the
+ * first and the iterable are split out, so that the first source and the
+ * rest can go through parse_evaluation. */
+static int split_map_arguments(PyObject *args, Py_ssize_t count, PyObject **script_args, PyObject **sources,
+        PyObject **iterator) {
+    Py_ssize_t i;
+
+    if (PyTuple_GET_SIZE(args) < count + 1) {
+        PyErr_Format(PyExc_TypeError, "expected %d function sources and an iterable", (int) count);
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        PyObject *source = PyTuple_GET_ITEM(args, i);
+        if (!PyString_Check(source) && !PyUnicode_Check(source)) {
+            PyErr_Format(PyExc_TypeError, "function sources must be strings");
+            return 0;
+        }
+    }
+
+    *iterator = PyObject_GetIter(PyTuple_GET_ITEM(args, count));
+    if (!*iterator) {
+        return 0;
+    }
+    *sources = PyTuple_GetSlice(args, 0, count);
+    *script_args = PyTuple_New(PyTuple_GET_SIZE(args) - count);
+    if (!*sources || !*script_args) {
+        Py_CLEAR(*iterator);
+        Py_CLEAR(*sources);
+        Py_CLEAR(*script_args);
+        return 0;
+    }
+
+    Py_INCREF(PyTuple_GET_ITEM(args, 0));
+    PyTuple_SET_ITEM(*script_args, 0, PyTuple_GET_ITEM(args, 0));
+    for (i = count + 1; i < PyTuple_GET_SIZE(args); i++) {
+        PyObject *item = PyTuple_GET_ITEM(args, i);
+        Py_INCREF(item);
+        PyTuple_SET_ITEM(*script_args, i - count, item);
+    }
+    return 1;
+}
+
+/* Iterator behind map(): one runner, fed a chunk at a time from the
+ * iterable, yielding results lazily. */
+typedef struct {
+    PyObject_HEAD
+    struct map_runner runner;
+    PyObject *args;
+    PyObject *kwargs;
+    PyObject *iterator;
+    PyObject *results;
+    Py_ssize_t position;
+    int exhausted;
+    int running;
+} MapperObject;
+
+static void Mapper_dealloc(MapperObject *self) {
+    close_map_runner(&self->runner);
+    Py_XDECREF(self->results);
+    Py_XDECREF(self->iterator);
+    Py_XDECREF(self->args);
+    Py_XDECREF(self->kwargs);
+    PyObject_Del(self);
+}
+
+static PyObject *Mapper_iternext(MapperObject *self) {
+    while (!self->results || self->position == PyList_GET_SIZE(self->results)) {
+        Py_CLEAR(self->results);
+        if (self->exhausted) {
+            return NULL;
+        }
+        if (self->running) {
+            return PyErr_Format(PyExc_ValueError, "map is already running");
+        }
+
+        PyObject *records = next_chunk(self->iterator, self->runner.chunk_size);
+        if (!records || PyList_GET_SIZE(records) == 0) {
+            self->exhausted = 1;
+            Py_XDECREF(records);
+            return NULL;
+        }
+        self->running = 1;
+        self->results = run_map_chunk(&self->runner, records);
+        self->running = 0;
+        Py_DECREF(records);
+        if (!self->results) {
+            self->exhausted = 1;
+            return NULL;
+        }
+        self->position = 0;
+    }
+
+    PyObject *result = PyList_GET_ITEM(self->results, self->position++);
+    Py_INCREF(result);
+    return result;
+}
+
+static PyTypeObject MapperType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "spindly.Mapper",
+    .tp_basicsize = sizeof(MapperObject),
+    .tp_dealloc = (destructor) Mapper_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "results of a javascript function applied over an iterable",
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc) Mapper_iternext,
+};
+
+/* map(function, iterable, ...) takes the options of js() plus chunk_size,
+ * the number of records converted and called per GIL release.  params and
+ * functions are defined once on the function's global. */
+static PyObject *spindly_map(PyObject *self, PyObject *args, PyObject *kwargs) {
+    Py_ssize_t chunk_size = DEFAULT_CHUNK_SIZE;
+    struct evaluation evaluation;
+    PyObject *sources = NULL;
+
+    MapperObject *mapper = PyObject_New(MapperObject, &MapperType);
+    if (!mapper) {
+        return NULL;
+    }
+    memset((char *) mapper + sizeof(PyObject), 0, sizeof(MapperObject) - sizeof(PyObject));
+
+    if (!copy_keywords(kwargs, &mapper->kwargs)
+            || !pop_size_keyword(mapper->kwargs, "chunk_size", &chunk_size)
+            || !split_map_arguments(args, 1, &mapper->args, &sources, &mapper->iterator)
+            || !parse_evaluation(mapper->args, mapper->kwargs, &evaluation, 0)) {
+        goto error;
+    }
+    if (evaluation.emit != NULL) {
+        PyErr_Format(PyExc_TypeError, "map() does not support emit");
+        goto error;
+    }
+    if (!open_map_runner(&mapper->runner, &evaluation, chunk_size, sources, 0)) {
+        goto error;
+    }
+    Py_DECREF(sources);
+    return (PyObject *) mapper;
+
+error:
+    Py_XDECREF(sources);
+    Py_DECREF(mapper);
+    return NULL;
+}
+
+/* Chunks handed between parallel_map() and its workers.  records is set
+ * while the chunk waits for a worker; results or the error afterwards. */
+struct map_chunk {
+    Py_ssize_t sequence;
+    PyObject *records;
+    PyObject *results;
+    PyObject *error_type;
+    PyObject *error_value;
+    PyObject *error_traceback;
+    struct map_chunk *next;
+};
+
+static void free_map_chunk(struct map_chunk *chunk) {
+    Py_XDECREF(chunk->records);
+    Py_XDECREF(chunk->results);
+    Py_XDECREF(chunk->error_type);
+    Py_XDECREF(chunk->error_value);
+    Py_XDECREF(chunk->error_traceback);
+    PyMem_Free(chunk);
+}
+
+struct map_worker {
+    struct map_runner runner;
+    struct parallel_map *pool;
+    pthread_t thread;
+    int started;
+};
+
+/* Iterator behind parallel_map().  Every worker thread owns a runner with
+ * its own runtime and compiled function.  The consuming thread only feeds
+ * chunks into pending and collects them from done, keeping at most two
+ * chunks per worker in flight. */
+typedef struct parallel_map {
+    PyObject_HEAD
+    struct map_worker *workers;
+    Py_ssize_t worker_count;
+    PyObject *args;
+    PyObject *kwargs;
+    PyObject *iterator;
+    Py_ssize_t chunk_size;
+    int ordered;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    struct map_chunk *pending;
+    struct map_chunk **pending_tail;
+    struct map_chunk *done;
+    Py_ssize_t in_flight;
+    Py_ssize_t fed;
+    Py_ssize_t next_sequence;
+    int exhausted;
+    int failed;
+    int closing;
+    int running;
+    PyObject *results;
+    Py_ssize_t position;
+} ParallelMapperObject;
+
+static void *run_map_worker(void *ptr) {
+    struct map_worker *worker = (struct map_worker *) ptr;
+    ParallelMapperObject *pool = worker->pool;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->pending && !pool->closing) {
+            pthread_cond_wait(&pool->changed, &pool->mutex);
+        }
+        if (pool->closing) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        struct map_chunk *chunk = pool->pending;
+        pool->pending = chunk->next;
+        if (!pool->pending) {
+            pool->pending_tail = &pool->pending;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        PyGILState_STATE state = PyGILState_Ensure();
+        chunk->results = run_map_chunk(&worker->runner, chunk->records);
+        if (!chunk->results) {
+            PyErr_Fetch(&chunk->error_type, &chunk->error_value, &chunk->error_traceback);
+        }
+        Py_CLEAR(chunk->records);
+        PyGILState_Release(state);
+
+        pthread_mutex_lock(&pool->mutex);
+        chunk->next = pool->done;
+        pool->done = chunk;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return NULL;
+}
+
+static void ParallelMapper_dealloc(ParallelMapperObject *self) {
+    Py_ssize_t i;
+
+    if (self->workers) {
+        pthread_mutex_lock(&self->mutex);
+        self->closing = 1;
+        for (i = 0; i < self->worker_count; i++) {
+            if (self->workers[i].runner.context) {
+                JS_TriggerOperationCallback(self->workers[i].runner.context);
+            }
+        }
+        pthread_cond_broadcast(&self->changed);
+        pthread_mutex_unlock(&self->mutex);
+
+        Py_BEGIN_ALLOW_THREADS
+        for (i = 0; i < self->worker_count; i++) {
+            if (self->workers[i].started) {
+                pthread_join(self->workers[i].thread, NULL);
+            }
+        }
+        Py_END_ALLOW_THREADS
+
+        for (i = 0; i < self->worker_count; i++) {
+            close_map_runner(&self->workers[i].runner);
+        }
+        PyMem_Free(self->workers);
+        pthread_cond_destroy(&self->changed);
+        pthread_mutex_destroy(&self->mutex);
+    }
+
+    while (self->pending) {
+        struct map_chunk *chunk = self->pending;
+        self->pending = chunk->next;
+        free_map_chunk(chunk);
+    }
+    while (self->done) {
+        struct map_chunk *chunk = self->done;
+        self->done = chunk->next;
+        free_map_chunk(chunk);
+    }
+    Py_XDECREF(self->results);
+    Py_XDECREF(self->iterator);
+    Py_XDECREF(self->args);
+    Py_XDECREF(self->kwargs);
+    PyObject_Del(self);
+}
+
+/* Tops up pending with chunks from the iterable. */
+static int feed_map_workers(ParallelMapperObject *self) {
+    while (!self->exhausted && self->in_flight < self->worker_count * 2) {
+        PyObject *records = next_chunk(self->iterator, self->chunk_size);
+        if (!records) {
+            return 0;
+        }
+        if (PyList_GET_SIZE(records) == 0) {
+            Py_DECREF(records);
+            self->exhausted = 1;
+            break;
+        }
+
+        struct map_chunk *chunk = PyMem_Malloc(sizeof(struct map_chunk));
+        if (!chunk) {
+            Py_DECREF(records);
+            PyErr_NoMemory();
+            return 0;
+        }
+        memset(chunk, 0, sizeof(struct map_chunk));
+        chunk->sequence = self->fed++;
+        chunk->records = records;
+
+        pthread_mutex_lock(&self->mutex);
+        *self->pending_tail = chunk;
+        self->pending_tail = &chunk->next;
+        pthread_cond_broadcast(&self->changed);
+        pthread_mutex_unlock(&self->mutex);
+        self->in_flight++;
+    }
+    return 1;
+}
+
+/* Waits for the next chunk to yield: the next in sequence when ordered,
+ * otherwise whichever finished first. */
+static struct map_chunk *collect_map_chunk(ParallelMapperObject *self) {
+    struct map_chunk *chunk = NULL, **link;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->mutex);
+    while (!chunk) {
+        for (link = &self->done; *link; link = &(*link)->next) {
+            if (!self->ordered || (*link)->sequence == self->next_sequence) {
+                chunk = *link;
+                *link = chunk->next;
+                break;
+            }
+        }
+        if (!chunk) {
+            pthread_cond_wait(&self->changed, &self->mutex);
+        }
+    }
+    pthread_mutex_unlock(&self->mutex);
+    Py_END_ALLOW_THREADS
+
+    self->in_flight--;
+    self->next_sequence++;
+    return chunk;
+}
+
+static PyObject *ParallelMapper_iternext(ParallelMapperObject *self) {
+    while (!self->results || self->position == PyList_GET_SIZE(self->results)) {
+        Py_CLEAR(self->results);
+        if (self->failed) {
+            return NULL;
+        }
+        if (self->running) {
+            return PyErr_Format(PyExc_ValueError, "parallel_map is already running");
+        }
+        if (!feed_map_workers(self)) {
+            self->failed = 1;
+            return NULL;
+        }
+        if (self->in_flight == 0) {
+            return NULL;
+        }
+
+        self->running = 1;
+        struct map_chunk *chunk = collect_map_chunk(self);
+        self->running = 0;
+        if (!chunk->results) {
+            PyErr_Restore(chunk->error_type, chunk->error_value, chunk->error_traceback);
+            chunk->error_type = chunk->error_value = chunk->error_traceback = NULL;
+            free_map_chunk(chunk);
+            self->failed = 1;
+            return NULL;
+        }
+        self->results = chunk->results;
+        chunk->results = NULL;
+        free_map_chunk(chunk);
+        self->position = 0;
+    }
+
+    PyObject *result = PyList_GET_ITEM(self->results, self->position++);
+    Py_INCREF(result);
+    return result;
+}
+
+static PyTypeObject ParallelMapperType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "spindly.ParallelMapper",
+    .tp_basicsize = sizeof(ParallelMapperObject),
+    .tp_dealloc = (destructor) ParallelMapper_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "results of a javascript function applied over an iterable by worker threads",
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc) ParallelMapper_iternext,
+};
+
+/* Creates a pool from count function sources, an iterable and the options
+ * of map() plus workers, the number of worker threads (one per CPU by
+ * default), and, unless folding, ordered. */
+static ParallelMapperObject *new_map_pool(PyObject *args, PyObject *kwargs, Py_ssize_t count, int fold) {
+    Py_ssize_t chunk_size = DEFAULT_CHUNK_SIZE, workers = sysconf(_SC_NPROCESSORS_ONLN), i;
+    struct evaluation evaluation;
+    PyObject *sources = NULL;
+
+    ParallelMapperObject *pool = PyObject_New(ParallelMapperObject, &ParallelMapperType);
+    if (!pool) {
+        return NULL;
+    }
+    memset((char *) pool + sizeof(PyObject), 0, sizeof(ParallelMapperObject) - sizeof(PyObject));
+    pool->ordered = !fold;
+    pool->pending_tail = &pool->pending;
+
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (!copy_keywords(kwargs, &pool->kwargs)
+            || !pop_size_keyword(pool->kwargs, "chunk_size", &chunk_size)
+            || !pop_size_keyword(pool->kwargs, "workers", &workers)
+            || (!fold && !pop_flag_keyword(pool->kwargs, "ordered", &pool->ordered))
+            || !split_map_arguments(args, count, &pool->args, &sources, &pool->iterator)
+            || !parse_evaluation(pool->args, pool->kwargs, &evaluation, 0)) {
+        goto error;
+    }
+    if (evaluation.emit != NULL) {
+        PyErr_Format(PyExc_TypeError, "emit is not supported when mapping");
+        goto error;
+    }
+    pool->chunk_size = chunk_size;
+
+    pool->workers = PyMem_Malloc(sizeof(struct map_worker) * workers);
+    if (!pool->workers) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    memset(pool->workers, 0, sizeof(struct map_worker) * workers);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+    pool->worker_count = workers;
+
+    for (i = 0; i < workers; i++) {
+        struct map_worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        if (!open_map_runner(&worker->runner, &evaluation, chunk_size, sources, fold)) {
+            goto error;
+        }
+        if (pthread_create(&worker->thread, NULL, run_map_worker, worker) != 0) {
+            PyErr_Format(PyExc_SystemError, "unable to start map worker\n");
+            goto error;
+        }
+        worker->started = 1;
+    }
+    Py_DECREF(sources);
+    return pool;
+
+error:
+    Py_XDECREF(sources);
+    Py_DECREF(pool);
+    return NULL;
+}
+
+static PyObject *spindly_parallel_map(PyObject *self, PyObject *args, PyObject *kwargs) {
+    return (PyObject *) new_map_pool(args, kwargs, 1, 0);
+}
+
+/* Merges the partial states of an idle folding pool into the first
+ * worker's runtime with merge(state, partial).  Partials cross runtimes as
+ * Python objects; only the final state is returned. */
+static PyObject *merge_aggregates(ParallelMapperObject *pool) {
+    struct map_runner *target = &pool->workers[0].runner;
+    Py_ssize_t i;
+    jsval state;
+
+    for (i = 1; i < pool->worker_count; i++) {
+        struct map_runner *runner = &pool->workers[i].runner;
+        enter_context(runner->context, &runner->evaluation);
+        PyObject *partial = to_python_object(runner->context,
+            get_runtime_data(runner->context)->roots[runner->base + AGGREGATE_STATE]);
+        leave_context(runner->context);
+        if (!partial) {
+            return NULL;
+        }
+
+        enter_context(target->context, &target->evaluation);
+        jsval arguments[2];
+        JSBool ok = to_javascript_object(target->context, partial, &arguments[1]);
+        if (ok) {
+            jsval *roots = get_runtime_data(target->context)->roots + target->base;
+            arguments[0] = roots[AGGREGATE_STATE];
+            Py_BEGIN_ALLOW_THREADS
+            ok = JS_CallFunctionValue(target->context, target->global, roots[AGGREGATE_MERGE], 2, arguments, &state);
+            Py_END_ALLOW_THREADS
+            if (ok) {
+                get_runtime_data(target->context)->roots[target->base + AGGREGATE_STATE] = state;
+            } else {
+                JS_ClearPendingException(target->context);
+            }
+        }
+        leave_context(target->context);
+        Py_DECREF(partial);
+        if (!ok) {
+            if (!PyErr_Occurred()) {
+                PyErr_Format(PyExc_ValueError, "spindly: merge failed");
+            }
+            return NULL;
+        }
+    }
+
+    enter_context(target->context, &target->evaluation);
+    PyObject *result = to_python_object(target->context,
+        get_runtime_data(target->context)->roots[target->base + AGGREGATE_STATE]);
+    leave_context(target->context);
+    if (!result && !PyErr_Occurred()) {
+        PyErr_Format(PyExc_SystemError, "unable to convert result\n");
+    }
+    return result;
+}
+
+/* aggregate(init, step, merge, iterable, ...) folds the iterable across
+ * worker threads.  Every worker starts from init() and keeps its state in
+ * its own runtime, replacing it with step(state, record) for each record
+ * it receives.  The partial states are combined with merge(state, partial)
+ * once the iterable is exhausted.  It takes the options of map() plus
+ * workers. */
+static PyObject *spindly_aggregate(PyObject *self, PyObject *args, PyObject *kwargs) {
+    ParallelMapperObject *pool = new_map_pool(args, kwargs, 3, 1);
+    PyObject *result = NULL, *item;
+    if (!pool) {
+        return NULL;
+    }
+
+    while ((item = ParallelMapper_iternext(pool)) != NULL) {
+        Py_DECREF(item);
+    }
+    if (!PyErr_Occurred()) {
+        result = merge_aggregates(pool);
+    }
+    Py_DECREF(pool);
+    return result;
+}
+
+static PyObject *spindly_monotonic(PyObject *self) {
+    return PyFloat_FromDouble(monotonic_seconds());
+}
+
+static PyObject *spindly_metrics(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"reset", NULL};
+    int reset = 0, mode;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:metrics", kwlist, &reset)) {
+        return NULL;
+    }
+
+    PyObject *metrics = PyDict_New();
+    if (!metrics) {
+        return NULL;
+    }
+    for (mode = 0; mode < JIT_MODES; mode++) {
+        PyObject *entry = Py_BuildValue("{s:K,s:d}", "runs", jit_metrics[mode].runs,
+            "seconds", jit_metrics[mode].seconds);
+        if (!entry || PyDict_SetItemString(metrics, jit_names[mode], entry) < 0) {
+            Py_XDECREF(entry);
+            Py_DECREF(metrics);
+            return NULL;
+        }
+        Py_DECREF(entry);
+    }
+    if (reset) {
+        memset(jit_metrics, 0, sizeof(jit_metrics));
+    }
+    return metrics;
+}
 
 static PyMethodDef spindly_methods[] = {
-    {"js", spindly_js, METH_VARARGS, "execute javascript code"},
+    {"js", (PyCFunction) spindly_js, METH_VARARGS | METH_KEYWORDS, "execute javascript code"},
+    {"stream", (PyCFunction) spindly_stream, METH_VARARGS | METH_KEYWORDS, "iterate over emitted values"},
+    {"submit", (PyCFunction) spindly_submit, METH_VARARGS | METH_KEYWORDS, "run javascript code in the background"},
+    {"map", (PyCFunction) spindly_map, METH_VARARGS | METH_KEYWORDS, "apply a javascript function over an iterable"},
+    {"parallel_map", (PyCFunction) spindly_parallel_map, METH_VARARGS | METH_KEYWORDS,
+        "apply a javascript function over an iterable on worker threads"},
+    {"aggregate", (PyCFunction) spindly_aggregate, METH_VARARGS | METH_KEYWORDS,
+        "fold an iterable with javascript functions on worker threads"},
+    {"monotonic", (PyCFunction) spindly_monotonic, METH_NOARGS, "seconds on the clock deadlines use"},
+    {"metrics", (PyCFunction) spindly_metrics, METH_VARARGS | METH_KEYWORDS, "script runs and time per jit mode"},
     {NULL, NULL, 0, NULL}
 };
 
 PyMODINIT_FUNC initspindly(void) {
+    PyEval_InitThreads();
     PyDateTime_IMPORT;
-    (void) Py_InitModule("spindly", spindly_methods);
+
+    PyObject *array_module = PyImport_ImportModule("array");
+    if (!array_module) {
+        return;
+    }
+    array_type = PyObject_GetAttrString(array_module, "array");
+    Py_DECREF(array_module);
+    if (!array_type) {
+        return;
+    }
+
+    if (PyType_Ready(&RuntimeType) < 0 || PyType_Ready(&SessionType) < 0 || PyType_Ready(&StreamType) < 0
+            || PyType_Ready(&CallType) < 0 || PyType_Ready(&MapperType) < 0 || PyType_Ready(&ParallelMapperType) < 0
+            || PyType_Ready(&SandboxPoolType) < 0 || PyType_Ready(&ClientType) < 0) {
+        return;
+    }
+
+    PyObject *module = Py_InitModule("spindly", spindly_methods);
+    if (!module) {
+        return;
+    }
+    overloaded_error = PyErr_NewException("spindly.Overloaded", PyExc_RuntimeError, NULL);
+    if (!overloaded_error) {
+        return;
+    }
+    Py_INCREF(overloaded_error);
+    PyModule_AddObject(module, "Overloaded", overloaded_error);
+    cancelled_error = PyErr_NewException("spindly.Cancelled", PyExc_RuntimeError, NULL);
+    if (!cancelled_error) {
+        return;
+    }
+    Py_INCREF(cancelled_error);
+    PyModule_AddObject(module, "Cancelled", cancelled_error);
+    Py_INCREF(&RuntimeType);
+    PyModule_AddObject(module, "Runtime", (PyObject *) &RuntimeType);
+    Py_INCREF(&SessionType);
+    PyModule_AddObject(module, "Session", (PyObject *) &SessionType);
+    Py_INCREF(&StreamType);
+    PyModule_AddObject(module, "Stream", (PyObject *) &StreamType);
+    Py_INCREF(&CallType);
+    PyModule_AddObject(module, "Call", (PyObject *) &CallType);
+    Py_INCREF(&SandboxPoolType);
+    PyModule_AddObject(module, "SandboxPool", (PyObject *) &SandboxPoolType);
+    Py_INCREF(&ClientType);
+    PyModule_AddObject(module, "Client", (PyObject *) &ClientType);
+
+    /* Runtimes now outlive single calls, so the engine is shut down once. */
+    Py_AtExit(JS_ShutDown);
 }
@@ -0,0 +1,274 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* spindlyd: a local evaluation daemon.  It keeps a pool of warm engines
+ * (prelude loaded, compiled scripts cached) and serves requests over a
+ * Unix domain socket, so short-lived processes need not pay for engine
+ * start-up on every call.
+ *
+ * Every frame is a 32-bit big-endian payload length followed by the
+ * payload.  A request payload is the same JSON object the sandbox pool
+ * sends ({script, params, timeout}); a response payload is 'R' followed by
+ * the result JSON or 'E' followed by an error message.  A connection may
+ * carry any number of requests, answered in order.  A client that hangs up
+ * (or shuts down its sending side) cancels the request it is waiting on. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "frames.h"
+#include "sandbox.h"
+
+#define MAX_FRAME (64 * 1024 * 1024)
+
+/* A request being run, so that the monitor can cancel it; fd is -1 in a
+ * free entry. */
+struct running_request {
+    int fd;
+    struct sandbox_engine *engine;
+};
+
+struct engine_pool {
+    struct sandbox_engine **engines;
+    struct running_request *running;
+    int size;
+    int idle;
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+};
+
+static struct engine_pool pool;
+
+static struct sandbox_engine *acquire_engine(int fd) {
+    int i;
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.idle == 0) {
+        pthread_cond_wait(&pool.released, &pool.mutex);
+    }
+    struct sandbox_engine *engine = pool.engines[--pool.idle];
+    for (i = 0; pool.running[i].fd >= 0; i++);
+    pool.running[i].fd = fd;
+    pool.running[i].engine = engine;
+    pthread_mutex_unlock(&pool.mutex);
+    return engine;
+}
+
+static void release_engine(struct sandbox_engine *engine) {
+    int i;
+    pthread_mutex_lock(&pool.mutex);
+    for (i = 0; pool.running[i].engine != engine || pool.running[i].fd < 0; i++);
+    pool.running[i].fd = -1;
+    pool.engines[pool.idle++] = engine;
+    pthread_cond_signal(&pool.released);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+/* Watches the connections with a request running and cancels the request
+ * of any whose client has gone away. */
+static void *monitor_requests(void *ptr) {
+    struct pollfd *fds = calloc(pool.size, sizeof(struct pollfd));
+    struct sandbox_engine **engines = calloc(pool.size, sizeof(struct sandbox_engine *));
+    int i, count;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.mutex);
+        for (i = 0, count = 0; i < pool.size; i++) {
+            if (pool.running[i].fd >= 0) {
+                fds[count].fd = pool.running[i].fd;
+                fds[count].events = POLLRDHUP;
+                engines[count] = pool.running[i].engine;
+                count++;
+            }
+        }
+        pthread_mutex_unlock(&pool.mutex);
+
+        if (poll(fds, count, 50) <= 0) {
+            continue;
+        }
+        pthread_mutex_lock(&pool.mutex);
+        for (i = 0; i < count; i++) {
+            int j;
+            if (!(fds[i].revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+                continue;
+            }
+            for (j = 0; j < pool.size; j++) {
+                if (pool.running[j].fd == fds[i].fd && pool.running[j].engine == engines[i]) {
+                    sandbox_engine_cancel(pool.running[j].engine);
+                }
+            }
+        }
+        pthread_mutex_unlock(&pool.mutex);
+        usleep(50000);
+    }
+    return NULL;
+}
+
+static void *serve_connection(void *ptr) {
+    int fd = (int) (intptr_t) ptr;
+    char *request;
+    size_t length;
+    int retval;
+
+    while ((retval = frame_read(fd, &request, &length, MAX_FRAME)) > 0) {
+        size_t response_length;
+        struct sandbox_engine *engine = acquire_engine(fd);
+        const char *response = sandbox_engine_run(engine, request, length, &response_length);
+        retval = frame_write(fd, response, response_length);
+        release_engine(engine);
+        free(request);
+        if (retval < 0) {
+            break;
+        }
+    }
+    if (retval < 0 && errno == EMSGSIZE) {
+        static const char message[] = "Erequest too large";
+        frame_write(fd, message, sizeof(message) - 1);
+    }
+    close(fd);
+    return NULL;
+}
+
+static char *read_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    char *data = NULL;
+    long size;
+
+    if (file && fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = malloc(size + 1);
+        if (data && fread(data, 1, size, file) != (size_t) size) {
+            free(data);
+            data = NULL;
+        } else if (data) {
+            *length = size;
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+    return data;
+}
+
+/* Appends source to the prelude as a JSON string, escaping everything that
+ * is not printable ASCII so the prelude stays ASCII like every payload. */
+static int append_source(char **prelude, size_t *length, const char *source, size_t source_length) {
+    char *grown = realloc(*prelude, *length + source_length * 6 + 4);
+    size_t i, at;
+    if (!grown) {
+        return 0;
+    }
+    *prelude = grown;
+    at = *length;
+    grown[at] = at == 0 ? '[' : ',';
+    at++;
+    grown[at++] = '"';
+    for (i = 0; i < source_length; i++) {
+        unsigned char c = (unsigned char) source[i];
+        if (c == '"' || c == '\\') {
+            grown[at++] = '\\';
+            grown[at++] = c;
+        } else if (c < 0x20 || c > 0x7e) {
+            at += sprintf(grown + at, "\\u%04x", c);
+        } else {
+            grown[at++] = c;
+        }
+    }
+    grown[at++] = '"';
+    *length = at;
+    return 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: spindlyd --socket PATH [--workers N] [--prelude FILE]...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    char *prelude = NULL;
+    size_t prelude_length = 0;
+    int workers = 4;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--prelude") == 0 && i + 1 < argc) {
+            size_t length;
+            char *source = read_file(argv[++i], &length);
+            if (!source || !append_source(&prelude, &prelude_length, source, length)) {
+                fprintf(stderr, "spindlyd: cannot read %s\n", argv[i]);
+                return 1;
+            }
+            free(source);
+        } else {
+            usage();
+        }
+    }
+    if (!path || workers < 1) {
+        usage();
+    }
+    if (prelude) {
+        prelude = realloc(prelude, prelude_length + 1);
+        prelude[prelude_length++] = ']';
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    pool.engines = calloc(workers, sizeof(struct sandbox_engine *));
+    pool.running = calloc(workers, sizeof(struct running_request));
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.released, NULL);
+    for (pool.size = 0; pool.size < workers; pool.size++) {
+        pool.engines[pool.size] = sandbox_engine_open(prelude, prelude_length);
+        if (!pool.engines[pool.size]) {
+            fprintf(stderr, "spindlyd: cannot start engine (bad prelude?)\n");
+            return 1;
+        }
+    }
+    pool.idle = pool.size;
+    free(prelude);
+    for (i = 0; i < pool.size; i++) {
+        pool.running[i].fd = -1;
+    }
+
+    pthread_t monitor;
+    if (pthread_create(&monitor, NULL, monitor_requests, NULL) != 0) {
+        perror("spindlyd");
+        return 1;
+    }
+
+    int listener = frame_listen(path, 64);
+    if (listener < 0) {
+        perror("spindlyd");
+        return 1;
+    }
+
+    for (;;) {
+        pthread_t thread;
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("spindlyd");
+            return 1;
+        }
+        if (pthread_create(&thread, NULL, serve_connection, (void *) (intptr_t) fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -1,6 +1,28 @@
-from unittest import TestCase
+import errno
+import os
+import signal
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from array import array
+from unittest import TestCase, skipIf
 
-from spindly import js
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+from spindly import (aggregate, js, map as js_map, metrics, monotonic, parallel_map, stream, submit, Cancelled,
+    Client, Overloaded, Runtime, SandboxPool, Session)
+
+def wait_until(condition, timeout=10):
+    limit = time.time() + timeout
+    while not condition():
+        if time.time() > limit:
+            raise AssertionError('condition not reached in %ss' % timeout)
+        time.sleep(0.01)
 
 class TestSpindly(TestCase):
     def test_javascript_primitives(self):
@@ -10,3 +32,473 @@ class TestSpindly(TestCase):
         self.assertEqual(js('"alpha"'), 'alpha')
         self.assertEqual(js('1'), 1)
         self.assertEqual(js('1.2'), 1.2)
+
+    def test_params(self):
+        params = {'id': 1, u'name': 'alpha', 'nested': {'id': 2}}
+        self.assertEqual(js('id + nested.id', params), 3)
+        self.assertEqual(js('name', params), 'alpha')
+        self.assertEqual(js('[x.id for each (x in list)]', {'list': [{'id': 1}, {'id': 2}]}), [1, 2])
+
+    def test_sequence_params(self):
+        self.assertEqual(js('values', {'values': [1, 2, 3]}), [1, 2, 3])
+        self.assertEqual(js('values', {'values': (1.5, 2.5)}), [1.5, 2.5])
+        self.assertEqual(js('values', {'values': [1, 'a', [2.5]]}), [1, 'a', [2.5]])
+        self.assertEqual(js('values[0]', {'values': [2 ** 40]}), 2 ** 40)
+
+    def test_javascript_arrays(self):
+        self.assertEqual(js('[1, "a", [true]]'), [1, 'a', [True]])
+        self.assertEqual(js('var a = []; a[3] = 1; a'), [None, None, None, 1])
+        self.assertEqual(len(js('var a = []; for (var i = 0; i < 100000; i++) a.push(i); a')), 100000)
+
+    def test_javascript_objects(self):
+        self.assertEqual(js('({a: 1, b: {c: "d"}})'), {'a': 1, 'b': {'c': 'd'}})
+        self.assertEqual(js('({1: "one", two: 2})'), {1: 'one', 'two': 2})
+        rows = js('var rows = []; for (var i = 0; i < 3; i++) rows.push({id: i}); rows')
+        self.assertEqual(rows, [{'id': 0}, {'id': 1}, {'id': 2}])
+        self.assertIs(list(rows[0])[0], list(rows[2])[0])
+
+    def test_buffer_params(self):
+        self.assertEqual(js('b instanceof Uint8Array && b[1]', {'b': bytearray('abc')}), ord('b'))
+        self.assertEqual(js('m.length', {'m': memoryview(bytearray(16))}), 16)
+        self.assertIs(js('a instanceof Float64Array', {'a': array('d', [1.5, 2.5])}), True)
+        self.assertEqual(js('a[0] + a[1]', {'a': array('i', [1, 2])}), 3)
+        self.assertEqual(js('s', {'s': 'bytes stay strings'}), 'bytes stay strings')
+
+    def test_array_interface(self):
+        class Interface(object):
+            def __init__(self, data, shape):
+                self.__array_interface__ = {'typestr': '|u1', 'data': (data, True), 'shape': shape,
+                    'version': 3}
+
+        values = array('B', [1, 2, 3, 4])
+        address = values.buffer_info()[0]
+        self.assertEqual(js('v.length + v[3]', {'v': Interface(address, (2, 2))}), 8)
+        self.assertRaises(ValueError, js, '0', {'v': Interface(address, (-2, -2))})
+        self.assertRaises(ValueError, js, '0', {'v': Interface(address, (2 ** 40, 2 ** 40))})
+
+    def test_typed_array_results(self):
+        result = js('new Float64Array([1.5, 2.5])')
+        self.assertEqual(result, array('d', [1.5, 2.5]))
+        self.assertEqual(js('new Uint8Array([1, 2, 255])'), array('B', [1, 2, 255]))
+        self.assertEqual(js('new Int32Array(new ArrayBuffer(16), 4, 2)'), array('i', [0, 0]))
+        self.assertEqual(js('new ArrayBuffer(4)'), bytearray(4))
+
+    @skipIf(numpy is None, 'numpy is not installed')
+    def test_numpy_arrays(self):
+        values = numpy.arange(6, dtype=numpy.float64)
+        self.assertIs(js('v instanceof Float64Array', {'v': values}), True)
+        self.assertEqual(js('v[5]', {'v': values}), 5.0)
+        self.assertEqual(js('v[2]', {'v': values[::2]}), 4.0)
+        self.assertEqual(js('v[1]', {'v': numpy.array([1, 2 ** 40])}), 2 ** 40)
+        result = js('new Int16Array([1, 2, 3])', numpy=True)
+        self.assertEqual(result.dtype, numpy.int16)
+        self.assertEqual(result.tolist(), [1, 2, 3])
+
+    def test_shared_references(self):
+        shared = {'x': 1}
+        self.assertIs(js('a === b', {'a': shared, 'b': [shared][0]}), True)
+        cycle = []
+        cycle.append(cycle)
+        self.assertIs(js('c[0] === c', {'c': cycle}), True)
+
+        result = js('var s = {x: 1}; [s, s]')
+        self.assertIs(result[0], result[1])
+        result = js('var c = {}; c.self = c; c')
+        self.assertIs(result['self'], result)
+
+        # getters hand out fresh objects and churn the heap mid-conversion
+        script = ('var o = {}; for (var i = 0; i < 200; i++) (function (n) { o.__defineGetter__("k" + n, '
+                  'function () { for (var j = 0; j < 2000; j++) [j, {}]; return {n: n}; }); })(i); o')
+        result = js(script)
+        self.assertEqual(sorted(value['n'] for value in result.values()), range(200))
+        self.assertTrue(all(result['k%d' % i] == {'n': i} for i in range(200)))
+
+    def test_deep_nesting(self):
+        deep = []
+        for i in range(200000):
+            deep = [deep]
+        self.assertEqual(js('var n = 0; while (d.length) { d = d[0]; n++; } n', {'d': deep}), 200000)
+        result = js('var d = []; for (var i = 0; i < 200000; i++) d = [d]; d')
+        self.assertEqual(len(result), 1)
+        self.assertRaises(ValueError, js, 'd', {'d': deep}, max_depth=1000)
+        for nested, script in (([[1]], '[[1]]'), ({'a': {'b': 1}}, '({a: {b: 1}})')):
+            self.assertEqual(js('d', {'d': nested}, max_depth=2), nested)
+            self.assertRaises(ValueError, js, '0', {'d': nested}, max_depth=1)
+            self.assertEqual(js(script, max_depth=2), nested)
+            self.assertRaises(ValueError, js, script, max_depth=1)
+        self.assertRaises(ValueError, js, '[1, 2, 3]', max_nodes=2)
+
+    def test_runtime_prelude(self):
+        runtime = Runtime(prelude=['function double(x) { return x * 2; }', 'var base = 10;'])
+        self.assertEqual(runtime.js('double(x) + base', {'x': 2}), 14)
+        runtime.js('var leaked = 1; base = 0; 0')
+        self.assertEqual(runtime.js('typeof leaked'), 'undefined')
+        self.assertEqual(runtime.js('base'), 10)
+
+        self.assertRaises(ValueError, runtime.set_prelude, ['function double(x) {'])
+        self.assertEqual(runtime.js('double(1)'), 2)
+        runtime.set_prelude(['function double(x) { return x + x + 1; }'])
+        self.assertEqual(runtime.js('double(1)'), 3)
+        self.assertEqual(runtime.js('typeof base'), 'undefined')
+        self.assertEqual(len(runtime.prelude), 1)
+
+    def test_session(self):
+        session = Session(prelude=['var base = 10;'])
+        session.run('var total = 0; function add(n) { total += n; return total; } 0')
+        self.assertEqual(session.run('add(x)', {'x': 5}), 5)
+        self.assertEqual(session.run('add(x)', {'x': 2}), 7)
+        self.assertEqual(session.run('x'), 2)
+        self.assertEqual(session.run('base = total + base'), 17)
+        self.assertEqual(Session(prelude=['var base = 10;']).run('typeof total + base'), 'undefined10')
+        self.assertRaises(ValueError, session.run, 'throw "bad"')
+        self.assertEqual(session.run('total'), 7)
+
+    def test_reentrant_runtime(self):
+        runtime = Runtime()
+        again = {'again': lambda: runtime.js('1')}
+        self.assertRaises(RuntimeError, runtime.js, 'again()', functions=again)
+        self.assertEqual(runtime.js('2'), 2)
+        session = Session()
+        again = {'again': lambda: session.run('1')}
+        self.assertRaises(RuntimeError, session.run, 'again()', functions=again)
+        self.assertEqual(session.run('2'), 2)
+
+    def test_session_reset(self):
+        session = Session(prelude=['var base = 10; function get() { return base; }'])
+        session.run('var extra = 1; base = 20; 0')
+        self.assertEqual(session.run('get() + base'), 30)
+        session.reset()
+        self.assertEqual(session.run('typeof extra'), 'undefined')
+        self.assertEqual(session.run('get() + base'), 20)
+        for i in range(1000):
+            session.reset()
+        self.assertEqual(session.run('base'), 10)
+
+    def test_lazy_standard_classes(self):
+        self.assertEqual(js('1 + 2'), 3)
+        self.assertEqual(js('Math.max(1, 2)'), 2)
+        self.assertEqual(js('JSON.stringify([1])'), '[1]')
+        self.assertEqual(js('typeof RegExp'), 'function')
+        self.assertIs(js('"Date" in this'), True)
+
+    def test_jit_modes(self):
+        script = 'var t = 0; for (var i = 0; i < 1000; i++) { t += i; } t'
+        metrics(reset=True)
+        for jit in (False, 'trace', 'method', True):
+            self.assertEqual(js(script, jit=jit), 499500)
+        self.assertEqual(Runtime(jit=True).js(script), 499500)
+        self.assertRaises(ValueError, js, '1', jit='fast')
+
+        counts = metrics()
+        self.assertEqual(counts['interpreter']['runs'], 1)
+        self.assertEqual(counts['auto']['runs'], 2)
+
+    def test_host_functions(self):
+        calls = []
+
+        def lookup(key, default=None):
+            calls.append(key)
+            return {'a': [1, 2]}.get(key, default)
+
+        functions = {'lookup': lookup}
+        self.assertEqual(js('lookup("a")[1] + lookup("b", 3)', functions=functions), 5)
+        self.assertEqual(calls, ['a', 'b'])
+        self.assertEqual(Runtime().js('lookup("a").length', functions=functions), 2)
+
+        def fail():
+            raise KeyError('missing')
+        self.assertRaises(KeyError, js, 'try { fail(); } catch (e) {} 1', functions={'fail': fail})
+        self.assertRaises(TypeError, js, '1', functions={'f': 1})
+
+    def test_emit(self):
+        seen = []
+        self.assertEqual(js('for (var i = 0; i < 3; i++) emit({n: i}); "done"', emit=seen.append), 'done')
+        self.assertEqual(seen, [{'n': 0}, {'n': 1}, {'n': 2}])
+
+        rows = stream('for (var i = 0; i < n; i++) emit([i, i * i]); n', {'n': 10000}, buffer=16)
+        total = 0
+        for i, row in enumerate(rows):
+            self.assertEqual(row, [i, i * i])
+            total += 1
+        self.assertEqual(total, 10000)
+        self.assertEqual(rows.result, 10000)
+
+        rows = stream('for (var i = 0; i < 3; i++) emit(i); "done"', buffer=1, timeout=1)
+        values = []
+        for value in rows:
+            values.append(value)
+            time.sleep(0.8)
+        self.assertEqual((values, rows.result), ([0, 1, 2], 'done'))
+
+        rows = stream('emit(1); throw "broken";')
+        self.assertEqual(next(rows), 1)
+        self.assertRaises(ValueError, next, rows)
+        del rows
+        stream('while (true) emit(0);', buffer=1)
+
+    def test_submit(self):
+        call = submit('x * 2', {'x': 21})
+        self.assertEqual(call.result(), 42)
+        self.assertTrue(call.done())
+        self.assertFalse(call.cancel())
+        self.assertRaises(ValueError, submit('throw "bad"').result)
+
+        call = submit('while (true) {}', timeout=0)
+        self.assertRaises(RuntimeError, call.result, timeout=0.1)
+        self.assertTrue(call.cancel())
+        self.assertRaises(Cancelled, call.result, timeout=5)
+        self.assertTrue(call.cancelled())
+
+        call = submit('while (true) { try { while (true) {} } catch (e) {} }', timeout=0)
+        self.assertRaises(RuntimeError, call.result, timeout=0.1)
+        self.assertTrue(call.cancel())
+        self.assertRaises(Cancelled, call.result, timeout=5)
+
+    def test_map(self):
+        records = ({'id': i, 'tags': ['a'] * (i % 3)} for i in range(1000))
+        results = js_map('function (r) { return r.id * scale + r.tags.length; }', records,
+            {'scale': 2}, chunk_size=64)
+        self.assertEqual(list(results), [i * 2 + i % 3 for i in range(1000)])
+        self.assertEqual(list(js_map('function (x) { return x; }', [])), [])
+
+        results = js_map('function (x) { if (x > 1) throw "bad"; return x; }', range(5), chunk_size=1)
+        self.assertEqual(next(results), 0)
+        self.assertEqual(next(results), 1)
+        self.assertRaises(ValueError, next, results)
+        self.assertRaises(TypeError, js_map, '1 + 1', [])
+
+    def test_deadline(self):
+        started = time.time()
+        self.assertRaises(ValueError, js, 'while (true) {}', timeout=0, deadline=monotonic() + 0.2)
+        self.assertTrue(time.time() - started < 1)
+        self.assertRaises(ValueError, js, '1', deadline=monotonic() - 1)
+        self.assertTrue(0 < js('__remaining_ms()', deadline=monotonic() + 5) <= 5000)
+        self.assertEqual(js('__remaining_ms()', timeout=0), float('inf'))
+        self.assertEqual(js('delete __remaining_ms; typeof __remaining_ms'), 'function')
+        session = Session()
+        session.run('__remaining_ms = 1; 0')
+        self.assertEqual(session.run('typeof __remaining_ms'), 'function')
+
+        slow = 'function (x) { var end = Date.now() + 50; while (Date.now() < end) {} return x; }'
+        started = time.time()
+        results = js_map(slow, range(100), chunk_size=1, deadline=monotonic() + 0.3)
+        self.assertRaises(ValueError, list, results)
+        self.assertTrue(time.time() - started < 1)
+
+        pool = SandboxPool(workers=1)
+        try:
+            self.assertTrue(pool.js('__remaining_ms() <= 1000', deadline=monotonic() + 1))
+            self.assertRaises(ValueError, pool.js, 'while (true) {}', deadline=monotonic() + 0.2)
+            self.assertRaises(ValueError, pool.js, '1', deadline=monotonic() - 1)
+
+            pool.stats(reset=True)
+            busy = 'var end = Date.now() + 500; while (Date.now() < end) {} 1'
+            thread = threading.Thread(target=pool.js, args=(busy,))
+            thread.start()
+            wait_until(lambda: pool.stats()['calls'] == 1)
+            self.assertRaises(ValueError, pool.js, '1', deadline=monotonic() + 0.1)
+            thread.join()
+            stats = pool.stats()
+            self.assertEqual((stats['calls'], stats['rejected']), (1, 1))
+        finally:
+            pool.close()
+
+    def test_parallel_map(self):
+        source = 'function (x) { var t = 0; for (var i = 0; i < x; i++) t += i; return t; }'
+        expected = [x * (x - 1) // 2 for x in range(2000)]
+        self.assertEqual(list(parallel_map(source, range(2000), workers=4, chunk_size=50)), expected)
+        unordered = parallel_map(source, range(2000), workers=4, chunk_size=50, ordered=False)
+        self.assertEqual(sorted(unordered), sorted(expected))
+
+        results = parallel_map('function (x) { if (x == 7) throw "bad"; return x; }', range(100), workers=2)
+        self.assertRaises(ValueError, list, results)
+        del results
+        parallel_map(source, range(100000), workers=2, chunk_size=1)
+
+    def test_aggregate(self):
+        histogram = aggregate(
+            'function () { return {count: 0, buckets: {}}; }',
+            'function (s, x) { s.count++; var b = x % 4; s.buckets[b] = (s.buckets[b] || 0) + 1; return s; }',
+            'function (a, b) { a.count += b.count; for (var k in b.buckets) '
+            'a.buckets[k] = (a.buckets[k] || 0) + b.buckets[k]; return a; }',
+            range(1000), workers=3, chunk_size=37)
+        self.assertEqual(histogram, {'count': 1000, 'buckets': {0: 250, 1: 250, 2: 250, 3: 250}})
+        self.assertEqual(js('o[2] + o.a', {'o': {2: 'x', 'a': 'y'}}), 'xy')
+
+        total = aggregate('function () { return 0; }', 'function (s, x) { return s + x * k; }',
+            'function (a, b) { return a + b; }', range(100), {'k': 2})
+        self.assertEqual(total, 9900)
+        self.assertRaises(ValueError, aggregate, 'function () { return 0; }',
+            'function (s, x) { throw "bad"; }', 'function (a, b) { return a + b; }', [1])
+
+    def test_sandbox_pool(self):
+        pool = SandboxPool(workers=2, prelude=['function double(x) { return x * 2; }'], max_calls=3,
+            ring_size=256)
+        try:
+            for i in range(10):
+                self.assertEqual(pool.js('double(x)', {'x': i}), i * 2)
+            self.assertEqual(pool.js('({s: s + "\\u00e9", n: [1, null]})', {'s': u'caf'}),
+                {'s': u'caf\xe9', 'n': [1, None]})
+            self.assertEqual(len(pool.js('new Array(2000).join("x")')), 1999)
+            self.assertRaises(ValueError, pool.js, 'throw "bad"')
+            self.assertRaises(ValueError, pool.js, 'while (true) {}', timeout=1)
+            self.assertEqual(pool.js('1 + 1'), 2)
+        finally:
+            pool.close()
+        self.assertRaises(ValueError, SandboxPool, prelude=['function ('])
+
+    def test_sandbox_admission(self):
+        def occupy(pool, results):
+            try:
+                results.append(pool.js('var end = Date.now() + 1000; while (Date.now() < end) {} 1'))
+            except Exception as e:
+                results.append(e)
+
+        pool = SandboxPool(workers=1, max_queue=1)
+        results = []
+        try:
+            threads = [threading.Thread(target=occupy, args=(pool, results)) for i in range(2)]
+            threads[0].start()
+            wait_until(lambda: pool.stats()['calls'] == 1)
+            threads[1].start()
+            wait_until(lambda: pool.stats()['queued'] == 1)
+            self.assertRaises(Overloaded, pool.js, '1')
+            for thread in threads:
+                thread.join()
+            self.assertEqual(results, [1, 1])
+            stats = pool.stats(reset=True)
+            self.assertEqual((stats['calls'], stats['rejected'], stats['queued']), (2, 1, 0))
+            self.assertTrue(stats['max_wait_seconds'] > 0)
+        finally:
+            pool.close()
+
+        pool = SandboxPool(workers=1, max_wait=0.1)
+        results = []
+        try:
+            thread = threading.Thread(target=occupy, args=(pool, results))
+            thread.start()
+            wait_until(lambda: pool.stats()['calls'] == 1)
+            self.assertRaises(Overloaded, pool.js, '1')
+            thread.join()
+            self.assertEqual(results, [1])
+            self.assertEqual(pool.js('2'), 2)
+        finally:
+            pool.close()
+
+    def test_sandbox_zygote_death(self):
+        def parent(pid):
+            try:
+                with open('/proc/%s/stat' % pid) as stat:
+                    return int(stat.read().rsplit(')', 1)[1].split()[1])
+            except (IOError, ValueError):
+                return None
+
+        pool = SandboxPool(workers=1)
+        try:
+            self.assertEqual(pool.js('1'), 1)
+            zygotes = [int(pid) for pid in os.listdir('/proc') if pid.isdigit() and parent(pid) == os.getpid()]
+            self.assertEqual(len(zygotes), 1)
+            os.kill(zygotes[0], signal.SIGKILL)
+            os.waitpid(zygotes[0], 0)
+            self.assertRaises((RuntimeError, ValueError), pool.js, '1', timeout=1)
+            with self.assertRaises(OSError) as raised:
+                pool.js('1')
+            self.assertEqual(raised.exception.errno, errno.ECHILD)
+        finally:
+            pool.close()
+
+    def test_sandbox_priorities(self):
+        pool = SandboxPool(workers=1)
+        order = []
+
+        def call(name, priority, tenant, script='1'):
+            pool.js(script, priority=priority, tenant=tenant)
+            order.append(name)
+
+        try:
+            busy = 'var end = Date.now() + 1000; while (Date.now() < end) {} 1'
+            threads = [threading.Thread(target=call, args=('busy', 1, 'batch', busy))]
+            threads += [threading.Thread(target=call, args=('batch', 2, 'batch')) for i in range(3)]
+            threads.append(threading.Thread(target=call, args=('user', 0, 'user')))
+            threads[0].start()
+            wait_until(lambda: pool.stats()['calls'] == 1)
+            for queued, thread in enumerate(threads[1:], 1):
+                thread.start()
+                wait_until(lambda: pool.stats()['queued'] == queued)
+            for thread in threads:
+                thread.join()
+            self.assertEqual(order, ['busy', 'user', 'batch', 'batch', 'batch'])
+
+            tenants = pool.tenants()
+            self.assertEqual((tenants['batch']['calls'], tenants['user']['calls']), (4, 1))
+            self.assertTrue(tenants['batch']['cpu_seconds'] > 0.3)
+            self.assertTrue(tenants['user']['wait_seconds'] > 0)
+            pool.set_weight('user', 4)
+            self.assertEqual(pool.tenants()['user']['weight'], 4)
+            self.assertRaises(ValueError, pool.set_weight, 'user', 0)
+            self.assertRaises(ValueError, pool.js, '1', priority=3)
+        finally:
+            pool.close()
+
+    def test_sandbox_fair_share(self):
+        pool = SandboxPool(workers=1)
+        order = []
+
+        def call(tenant, script):
+            pool.js(script, tenant=tenant)
+            order.append(tenant)
+
+        try:
+            pool.set_weight('a', 3)
+            busy = 'var end = Date.now() + %d; while (Date.now() < end) {} 1'
+            hold = threading.Thread(target=call, args=('hold', busy % 1000))
+            hold.start()
+            wait_until(lambda: pool.stats()['calls'] == 1)
+            work = busy % 50
+            threads = [threading.Thread(target=call, args=(tenant, work)) for i in range(8) for tenant in 'ab']
+            for queued, thread in enumerate(threads, 1):
+                thread.start()
+                wait_until(lambda: pool.stats()['queued'] == queued)
+            for thread in [hold] + threads:
+                thread.join()
+            self.assertEqual(order[0], 'hold')
+            served = order[1:9]
+            self.assertTrue(served.count('a') >= 5, served)
+            self.assertIn('b', served)
+        finally:
+            pool.close()
+
+    def test_spindlyd_client(self):
+        if not os.path.exists('./spindlyd'):
+            subprocess.check_call([sys.executable, 'setup.py', 'build_spindlyd'])
+        directory = tempfile.mkdtemp()
+        path = os.path.join(directory, 'spindlyd.sock')
+        prelude = os.path.join(directory, 'prelude.js')
+        with open(prelude, 'w') as f:
+            f.write('function double(x) { return x * 2; }')
+        daemon = subprocess.Popen(['./spindlyd', '--socket', path, '--workers', '2', '--prelude', prelude])
+        try:
+            wait_until(lambda: os.path.exists(path) or daemon.poll() is not None)
+            self.assertIsNone(daemon.poll(), 'spindlyd exited at startup')
+            self.assertEqual(os.stat(path).st_mode & 0o777, 0o600)
+            client = Client(path)
+            for i in range(5):
+                self.assertEqual(client.js('double(x)', {'x': i}), i * 2)
+            self.assertEqual(client.js('({s: s + "!"})', {'s': u'caf\xe9'}), {'s': u'caf\xe9!'})
+            with self.assertRaises(ValueError) as raised:
+                client.js('throw "bad"')
+            self.assertIn('bad', str(raised.exception))
+            self.assertRaises(ValueError, client.js, 'while (true) {}', timeout=1)
+            self.assertEqual(client.js('1 + 1'), 2)
+            client.close()
+            self.assertRaises(OSError, client.js, '1')
+
+            client = Client(path, max_frame=64)
+            self.assertEqual(client.js('"x"'), 'x')
+            with self.assertRaises(OSError) as raised:
+                client.js('new Array(100).join("x")')
+            self.assertEqual(raised.exception.errno, errno.EMSGSIZE)
+            client.close()
+        finally:
+            daemon.kill()
+            daemon.wait()
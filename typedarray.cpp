@@ -0,0 +1,69 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <jsapi.h>
+#include <jstypedarray.h>
+
+#include "typedarray.h"
+
+using js::ArrayBuffer;
+using js::TypedArray;
+
+typedef char typed_array_types_match[
+    (int) TYPED_ARRAY_FLOAT64 == (int) TypedArray::TYPE_FLOAT64 &&
+    (int) TYPED_ARRAY_UINT8_CLAMPED == (int) TypedArray::TYPE_UINT8_CLAMPED ? 1 : -1];
+
+JSBool is_typed_array(JSObject *obj) {
+    return js_IsTypedArray(obj);
+}
+
+JSBool is_array_buffer(JSObject *obj) {
+    return js_IsArrayBuffer(obj);
+}
+
+JSObject *new_typed_array(JSContext *context, int type, jsuint length, void **data) {
+    JSObject *obj = js_CreateTypedArray(context, type, length);
+    if (!obj) {
+        return NULL;
+    }
+    *data = TypedArray::fromJSObject(obj)->data;
+    return obj;
+}
+
+JSBool get_typed_array(JSObject *obj, int *type, void **data, jsuint *length) {
+    if (!js_IsTypedArray(obj)) {
+        return JS_FALSE;
+    }
+    TypedArray *array = TypedArray::fromJSObject(obj);
+    *type = array->type;
+    *data = array->data;
+    *length = array->length;
+    return JS_TRUE;
+}
+
+JSBool get_array_buffer(JSObject *obj, void **data, jsuint *length) {
+    if (!js_IsArrayBuffer(obj)) {
+        return JS_FALSE;
+    }
+    ArrayBuffer *buffer = ArrayBuffer::fromJSObject(obj);
+    *data = buffer->data;
+    *length = buffer->byteLength;
+    return JS_TRUE;
+}
+
+size_t typed_array_item_size(int type) {
+    switch (type) {
+    case TYPED_ARRAY_INT16:
+    case TYPED_ARRAY_UINT16:
+        return 2;
+    case TYPED_ARRAY_INT32:
+    case TYPED_ARRAY_UINT32:
+    case TYPED_ARRAY_FLOAT32:
+        return 4;
+    case TYPED_ARRAY_FLOAT64:
+        return 8;
+    default:
+        return 1;
+    }
+}
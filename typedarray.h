@@ -0,0 +1,47 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef SPINDLY_TYPEDARRAY_H
+#define SPINDLY_TYPEDARRAY_H
+
+#include <jsapi.h>
+
+/* SpiderMonkey 1.8.5 only exposes typed array storage through its C++
+ * friend API; these wrappers make it reachable from C. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum typed_array_type {
+    TYPED_ARRAY_INT8 = 0,
+    TYPED_ARRAY_UINT8,
+    TYPED_ARRAY_INT16,
+    TYPED_ARRAY_UINT16,
+    TYPED_ARRAY_INT32,
+    TYPED_ARRAY_UINT32,
+    TYPED_ARRAY_FLOAT32,
+    TYPED_ARRAY_FLOAT64,
+    TYPED_ARRAY_UINT8_CLAMPED
+};
+
+JSBool is_typed_array(JSObject *obj);
+JSBool is_array_buffer(JSObject *obj);
+
+/* Creates a zero-filled typed array and returns its storage through data. */
+JSObject *new_typed_array(JSContext *context, int type, jsuint length, void **data);
+
+/* Returns JS_FALSE if obj is not a typed array. */
+JSBool get_typed_array(JSObject *obj, int *type, void **data, jsuint *length);
+
+/* Returns JS_FALSE if obj is not an ArrayBuffer. */
+JSBool get_array_buffer(JSObject *obj, void **data, jsuint *length);
+
+size_t typed_array_item_size(int type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif